@@ -0,0 +1,82 @@
+// WC HTTP2 Application Template. Token buckets of the send pacing
+//
+// Copyright 2023 Medvedkov Ilya
+//
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* Internal header. It has no ESP-IDF dependencies, so the bucket math
+ * is checked on host with tools/h2pca_bucket_check.c */
+
+#ifndef H2PCA_BUCKET_H
+#define H2PCA_BUCKET_H
+
+#include <stdint.h>
+
+/* tokens are kept in units * H2PCA_TOKEN_UNIT */
+#define H2PCA_TOKEN_UNIT        1000000
+/* rate scale of the full configured rate */
+#define H2PCA_RATE_SCALE_FULL   256
+
+/* Add the tokens for elapsed time. tokens = rate * elapsed(us) * scale
+ * @param tokens  [input] current tokens
+ * @param elapsed [input] time since the last refill (in us)
+ * @param rate    [input] units per second (0 - not limited)
+ * @param burst   [input] capacity of the bucket (in units)
+ * @param scale   [input] share of the rate (H2PCA_RATE_SCALE_FULL - full)
+ * @return the new value of tokens
+ */
+static inline int64_t h2pca_bucket_refill(int64_t tokens, int64_t elapsed, uint32_t rate,
+                                          uint32_t burst, uint16_t scale) {
+    int64_t cap = (int64_t) burst * H2PCA_TOKEN_UNIT;
+
+    if ((rate == 0) || (scale == 0) || (elapsed <= 0)) return tokens;
+
+    /* no more than the time to fill the empty bucket, so the product
+     * below can not overflow after a long idle */
+    int64_t fill_time = cap * H2PCA_RATE_SCALE_FULL / ((int64_t) rate * scale) + 1;
+    if (elapsed > fill_time)
+        elapsed = fill_time;
+
+    tokens += elapsed * rate * scale / H2PCA_RATE_SCALE_FULL;
+    if (tokens > cap)
+        tokens = cap;
+    return tokens;
+}
+
+/* Max size of the next msg allowed by the buckets. The full byte bucket
+ * passes one msg bigger than the burst, the debt is paid by the refill
+ * @return the max size (in bytes) or 0 if no msg is allowed
+ */
+static inline uint32_t h2pca_bucket_allowed(int64_t tokens_msgs, int64_t tokens_bytes,
+                                            uint32_t rate_msgs, uint32_t rate_bytes,
+                                            uint32_t burst_bytes) {
+    if ((rate_msgs > 0) && (tokens_msgs < H2PCA_TOKEN_UNIT))
+        return 0;
+
+    if (rate_bytes > 0) {
+        if (tokens_bytes >= (int64_t) burst_bytes * H2PCA_TOKEN_UNIT)
+            return UINT32_MAX;
+        if (tokens_bytes < H2PCA_TOKEN_UNIT)
+            return 0;
+
+        int64_t max_size = tokens_bytes / H2PCA_TOKEN_UNIT;
+        return (max_size < UINT32_MAX) ? (uint32_t) max_size : UINT32_MAX;
+    }
+    return UINT32_MAX;
+}
+
+/* Take the tokens of the msg of the given size */
+static inline void h2pca_bucket_take(int64_t * tokens_msgs, int64_t * tokens_bytes,
+                                     uint32_t rate_msgs, uint32_t rate_bytes, uint32_t size) {
+    if (rate_msgs > 0)
+        *tokens_msgs -= H2PCA_TOKEN_UNIT;
+    if (rate_bytes > 0)
+        *tokens_bytes -= (int64_t) size * H2PCA_TOKEN_UNIT;
+}
+
+#endif /* H2PCA_BUCKET_H */
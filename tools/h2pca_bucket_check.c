@@ -0,0 +1,69 @@
+// WC HTTP2 Application Template. Host check of the send pacing buckets
+//
+// Copyright 2023 Medvedkov Ilya
+//
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* Build and run on host from the component dir:
+ *   cc -I. -o /tmp/h2pca_bucket_check tools/h2pca_bucket_check.c && /tmp/h2pca_bucket_check
+ */
+
+#include <stdio.h>
+#include "h2pca_bucket.h"
+
+#define RATE_MSGS       0
+#define RATE_BYTES      8192
+#define BURST_BYTES     16384
+#define OVERSIZE        40000
+#define SMALL           100
+
+static int fails = 0;
+
+static void check(int cond, const char * what) {
+    printf("%s: %s\n", cond ? "ok  " : "FAIL", what);
+    if (!cond) fails++;
+}
+
+/* one batch as __om_flush does it. queue holds cnt msgs of the given size */
+static int batch(int64_t * tm, int64_t * tb, int cnt, uint32_t size) {
+    int sent = 0;
+    while (sent < cnt) {
+        uint32_t max_size = h2pca_bucket_allowed(*tm, *tb, RATE_MSGS, RATE_BYTES, BURST_BYTES);
+        if (max_size < size) break;
+        h2pca_bucket_take(tm, tb, RATE_MSGS, RATE_BYTES, size);
+        sent++;
+    }
+    return sent;
+}
+
+int main(void) {
+    int64_t tm = 0;
+    int64_t tb = (int64_t) BURST_BYTES * H2PCA_TOKEN_UNIT;
+
+    /* the full bucket passes one oversize msg */
+    check(batch(&tm, &tb, 1, OVERSIZE) == 1, "full bucket passes one oversize msg");
+    check(tb < 0, "oversize msg leaves the byte bucket in debt");
+
+    /* the debt holds back the next batch, even without the msgs limit */
+    check(batch(&tm, &tb, 1000, SMALL) == 0, "next batch is empty while in debt");
+    check(h2pca_bucket_allowed(tm, tb, RATE_MSGS, RATE_BYTES, BURST_BYTES) == 0,
+          "nothing allowed while in debt");
+
+    /* the refill pays the debt off, then the traffic goes at the rate */
+    tb = h2pca_bucket_refill(tb, 1000000, RATE_BYTES, BURST_BYTES, H2PCA_RATE_SCALE_FULL);
+    check(batch(&tm, &tb, 1000, SMALL) == 0, "still empty after 1s of 8192 B/s");
+    tb = h2pca_bucket_refill(tb, 3000000, RATE_BYTES, BURST_BYTES, H2PCA_RATE_SCALE_FULL);
+    int sent = batch(&tm, &tb, 1000, SMALL);
+    check((sent > 0) && (sent <= BURST_BYTES / SMALL), "paid off debt passes a bounded batch");
+
+    /* a long idle can not overflow the refill */
+    tb = h2pca_bucket_refill(0, INT64_MAX / 2, RATE_BYTES, BURST_BYTES, H2PCA_RATE_SCALE_FULL);
+    check(tb == (int64_t) BURST_BYTES * H2PCA_TOKEN_UNIT, "long idle refill is capped by burst");
+
+    return fails ? 1 : 0;
+}
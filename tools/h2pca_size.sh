@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# Build wch2pcapp.o for each combination of the compile-time options
+# (H2PCA_STATIC_HOOKS, H2PCA_NO_*) and print its size and the count of
+# indirect calls in the main loop
+#
+# Copyright 2023 Medvedkov Ilya
+#
+# Usage: IDF_PATH=... BUILD_DIR=<project>/build EXTRA_INCLUDES="-I..." tools/h2pca_size.sh
+#
+# BUILD_DIR is the build dir of an ESP-IDF v3 project that uses the
+# component (its include/sdkconfig.h is the base config). EXTRA_INCLUDES
+# adds the include dirs of wc_ble_config, wch2pc_esp32 and wcprotocol.
+# H2PCA_INCLUDES replaces the include dirs found in IDF_PATH and BUILD_DIR.
+# CC, SIZE, OBJDUMP, CFLAGS and ICALL_RE override the toolchain (xtensa
+# by default). HOOKS sets the hooks header of the static combinations,
+# by default on_begin_step and on_error are bound to extern functions.
+
+set -e
+
+COMP_DIR=$(cd "$(dirname "$0")/.." && pwd)
+CC=${CC:-xtensa-esp32-elf-gcc}
+SIZE=${SIZE:-xtensa-esp32-elf-size}
+OBJDUMP=${OBJDUMP:-xtensa-esp32-elf-objdump}
+CFLAGS=${CFLAGS:-"-std=gnu99 -Os -mlongcalls -ffunction-sections -fdata-sections"}
+# indirect call instruction in the disassembly
+ICALL_RE=${ICALL_RE:-"callx[0-9]"}
+
+if [ -z "$H2PCA_INCLUDES" ]; then
+    if [ -z "$IDF_PATH" ] || [ -z "$BUILD_DIR" ]; then
+        echo "Set IDF_PATH and BUILD_DIR (or H2PCA_INCLUDES)" >&2
+        exit 1
+    fi
+    H2PCA_INCLUDES="-I$BUILD_DIR/include -I$IDF_PATH/components/json/cJSON"
+    for dir in $(find "$IDF_PATH/components" -maxdepth 5 -type d -name include | sort); do
+        H2PCA_INCLUDES="$H2PCA_INCLUDES -I$dir"
+    done
+fi
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+if [ -z "$HOOKS" ]; then
+    HOOKS="$WORK_DIR/h2pca_size_hooks.h"
+    cat > "$HOOKS" <<EOF
+void size_begin_step(void);
+void size_on_error(int err);
+#define H2PCA_HOOK_on_begin_step() size_begin_step()
+#define H2PCA_HOOK_on_error(err)   size_on_error(err)
+EOF
+fi
+
+# name and options of the combinations
+COMBOS="dynamic:
+static:STATIC_HOOKS
+static_no_ble:STATIC_HOOKS,NO_BLE_CONFIG
+static_no_tasks:STATIC_HOOKS,NO_USER_TASKS
+static_no_inmsgs:STATIC_HOOKS,NO_INMSGS
+static_no_all:STATIC_HOOKS,NO_BLE_CONFIG,NO_USER_TASKS,NO_INMSGS"
+
+printf "%-18s %8s %8s %8s %8s %8s\n" "config" "text" "data" "bss" "dec" "icalls"
+
+echo "$COMBOS" | while IFS=: read -r name opts; do
+    dir="$WORK_DIR/$name"
+    mkdir -p "$dir"
+
+    # sdkconfig.h of the combination. it is found before the base one
+    {
+        echo "#ifndef H2PCA_SIZE_SDKCONFIG_H"
+        echo "#define H2PCA_SIZE_SDKCONFIG_H"
+        echo "#include_next <sdkconfig.h>"
+        for opt in STATIC_HOOKS HOOKS_HEADER NO_BLE_CONFIG NO_USER_TASKS NO_INMSGS; do
+            echo "#undef CONFIG_H2PCA_$opt"
+        done
+        for opt in $(echo "$opts" | tr ',' ' '); do
+            echo "#define CONFIG_H2PCA_$opt 1"
+        done
+        echo "#define CONFIG_H2PCA_HOOKS_HEADER \"$HOOKS\""
+        echo "#endif"
+    } > "$dir/sdkconfig.h"
+
+    $CC $CFLAGS -I"$dir" -I"$COMP_DIR" $H2PCA_INCLUDES $EXTRA_INCLUDES -include sdkconfig.h \
+        -c "$COMP_DIR/wch2pcapp.c" -o "$dir/wch2pcapp.o"
+
+    sizes=$($SIZE "$dir/wch2pcapp.o" | awk 'NR == 2 { print $1, $2, $3, $4 }')
+    icalls=$($OBJDUMP -d "$dir/wch2pcapp.o" |
+             awk '/^[0-9a-f]+ <.*>:$/ { f = ($2 ~ /^<__main_task/) } f' |
+             grep -c -E "$ICALL_RE" || true)
+
+    printf "%-18s %8s %8s %8s %8s %8s\n" "$name" $sizes "$icalls"
+done
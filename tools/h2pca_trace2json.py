@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+#
+# Convert the trace dumped with h2pca_trace_dump() to Chrome trace JSON
+# (open with chrome://tracing or https://ui.perfetto.dev)
+#
+# Copyright 2023 Medvedkov Ilya
+#
+# Usage: h2pca_trace2json.py [-o trace.json] [serial.log]
+
+import argparse
+import json
+import re
+import struct
+import sys
+
+# keep in sync with h2pca_trace_type in wch2pcapp.h
+SET_STATE = 1
+CLR_STATE = 2
+SYS_TIMER = 3
+USER_TIMER = 4
+PHASE_BEGIN = 5
+PHASE_END = 6
+REQ_BEGIN = 7
+REQ_END = 8
+OM_PRESSURE = 9
+RECOVERY = 10
+
+SYS_TIMERS = {0: "send_msgs", 1: "recv_msgs", 2: "telemetry"}
+PHASES = {0: "step", 1: "auth", 2: "recv", 3: "inmsgs", 4: "send", 5: "connect", 6: "sync",
+          7: "stream"}
+RECOVERY_TIERS = {0: "ignore", 1: "retry", 2: "reauth", 3: "reconnect", 4: "reboot"}
+REQUESTS = {0: "connect", 1: "authorize", 2: "get_msgs", 3: "send_msgs", 4: "keepalive"}
+STATES = {0: "WIFI_CONNECTED", 1: "HOST_CONNECTED", 2: "AUTHORIZED", 3: "MODE_SETIME",
+          4: "MODE_AUTH", 5: "MODE_RECIEVE_MSG", 6: "MODE_SEND_MSG"}
+
+TID_LOOP = 1
+TID_H2PC = 2
+TID_TIMERS = 3
+TID_STATE = 4
+
+EVENT_RE = re.compile(r"H2PCA_TRACE: ev ([0-9a-f]{32})")
+EVENT_FMT = "<IIHHI"
+
+
+def read_events(lines):
+    events = {}
+    for line in lines:
+        m = EVENT_RE.search(line)
+        if m is None:
+            continue
+        seq, ts, tp, eid, arg = struct.unpack(EVENT_FMT, bytes.fromhex(m.group(1)))
+        events[seq] = (ts, tp, eid, arg)
+    return [events[seq] for seq in sorted(events)]
+
+
+def state_names(mask):
+    names = [STATES.get(i, "BIT%d" % i) for i in range(24) if mask & (1 << i)]
+    return "|".join(names) if names else "0"
+
+
+def convert(events):
+    out = []
+    for tid, name in ((TID_LOOP, "main loop"), (TID_H2PC, "h2pc"),
+                      (TID_TIMERS, "timers"), (TID_STATE, "state")):
+        out.append({"ph": "M", "pid": 1, "tid": tid, "name": "thread_name", "args": {"name": name}})
+
+    state = 0
+    base = 0
+    prev_ts = None
+    for ts, tp, eid, arg in events:
+        # unwrap 32-bit timestamps
+        if prev_ts is not None and ts + base < prev_ts - (1 << 31):
+            base += 1 << 32
+        ts += base
+        prev_ts = ts
+
+        ev = {"pid": 1, "ts": ts}
+        if tp in (SET_STATE, CLR_STATE):
+            if tp == SET_STATE:
+                state |= arg
+                name = "set " + state_names(arg)
+            else:
+                state &= ~arg
+                name = "clr " + state_names(arg)
+            out.append(dict(ev, ph="i", s="t", tid=TID_STATE, name=name, args={"mask": hex(arg)}))
+            out.append(dict(ev, ph="C", tid=TID_STATE, name="state", args={"bits": state}))
+        elif tp == SYS_TIMER:
+            out.append(dict(ev, ph="i", s="t", tid=TID_TIMERS, name=SYS_TIMERS.get(eid, "sys%d" % eid)))
+        elif tp == USER_TIMER:
+            out.append(dict(ev, ph="i", s="t", tid=TID_TIMERS, name="task %d" % eid))
+        elif tp in (PHASE_BEGIN, PHASE_END):
+            out.append(dict(ev, ph="B" if tp == PHASE_BEGIN else "E", tid=TID_LOOP,
+                            name=PHASES.get(eid, "phase%d" % eid)))
+        elif tp == REQ_BEGIN:
+            out.append(dict(ev, ph="B", tid=TID_H2PC, name=REQUESTS.get(eid, "req%d" % eid)))
+        elif tp == REQ_END:
+            out.append(dict(ev, ph="E", tid=TID_H2PC, name=REQUESTS.get(eid, "req%d" % eid),
+                            args={"result": struct.unpack("<i", struct.pack("<I", arg))[0]}))
+        elif tp == OM_PRESSURE:
+            out.append(dict(ev, ph="i", s="t", tid=TID_STATE,
+                            name="om high" if eid else "om low", args={"msgs": arg}))
+        elif tp == RECOVERY:
+            out.append(dict(ev, ph="i", s="t", tid=TID_H2PC,
+                            name="recover " + RECOVERY_TIERS.get(eid, str(eid)), args={"error": arg}))
+    return {"traceEvents": out, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert h2pca trace dump to Chrome trace JSON")
+    parser.add_argument("log", nargs="?", help="serial log with the trace dump (stdin by default)")
+    parser.add_argument("-o", "--output", help="output file (stdout by default)")
+    args = parser.parse_args()
+
+    if args.log:
+        with open(args.log, "r", errors="replace") as f:
+            events = read_events(f)
+    else:
+        events = read_events(sys.stdin)
+
+    trace = convert(events)
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(trace, f)
+    else:
+        json.dump(trace, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
@@ -11,13 +11,20 @@
 
 
 #include "wch2pcapp.h"
+#include "h2pca_bucket.h"
 
 #include <sys/time.h>
 #include "lwip/apps/sntp.h"
+#include "lwip/dhcp.h"
 #include "esp_wifi.h"
 #include "esp_bt_defs.h"
 #include "esp_gap_bt_api.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_sleep.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_clk.h"
 
 #ifdef CONFIG_WC_USE_IO_STREAMS
 #include <wcframe.h>
@@ -25,6 +32,8 @@
 #include <wcprotocol.h>
 #include <ble_config.h>
 #include <errno.h>
+#include <stddef.h>
+#include <inttypes.h>
 
 /* wifi config */
 #define APP_WIFI_SSID CONFIG_WIFI_SSID
@@ -40,6 +49,8 @@
 
 #define DEVICE_CONFIG   "device_config"
 #define MAIN_TASK_NAME  "main_task"
+#define WORKER_TASK_NAME "h2pca_worker"
+#define TRACE_TAG       "H2PCA_TRACE"
 
 #define RECONNECT_TIMEOUT (30 * configTICK_RATE_HZ)
 
@@ -49,24 +60,398 @@
 #define GET_MSG_TIMER_DELTA                     4000000
 #define MAIN_TASK_LOOP_DELAY                    200
 #define STD_MSGS_CHUNK_SZ                       16
+#define DUTY_CYCLE_MAX_AWAKE                    30000000
+#define DUTY_CYCLE_MIN_SLEEP                    1000000
+
+#define RTC_STATE_MAGIC                         0x48325041
+#define WIFI_CACHE_MAGIC                        0x48325057
+/* the cached lease is not reused if it expires sooner (in us) */
+#define WIFI_LEASE_MARGIN                       60000000
+
+#define FNV_OFFSET_BASIS                        0x811c9dc5
+#define FNV_PRIME                               0x01000193
+/* seed of the second half of the dedup fingerprint */
+#define DEDUP_SEED2                             0x9e3779b9
+
+#define TASK_POOL_INIT_CAPACITY                 4
+
+#define WORKERS_CNT                             1
+#define WORKERS_PRIORITY                        5
+#define WORKERS_STACK_SIZE                      (1024 * 4)
+#define WORKERS_QUEUE_DEPTH                     8
+
+/* steps after which a pending sync event without deadline is due */
+#define SYNC_AGING_STEPS                        16
+/* max steps in a row without the loop delay for carried over events */
+#define SYNC_MAX_CARRIED_STEPS                  8
+
+#define SEND_BURST_MSGS                         64
+#define SEND_BURST_BYTES                        (1024 * 16)
+#define SEND_RATE_SCALE_MIN                     16
+#define SEND_RATE_SCALE_STEP                    16
+
+#define KEEPALIVE_PERIOD                        30000000
+#define KEEPALIVE_MAX_FAILS                     2
+
+#define ERROR_RETRY_BACKOFF                     500000
+#define ERROR_RETRY_MAX                         5
+/* max shift of the retry backoff */
+#define ERROR_RETRY_MAX_SHIFT                   5
+
+#define STREAM_FRAME_SIZE                       (1024 * 32)
+#define STREAM_FRAMES_PER_STEP                  1
 
 #define MAX_SYS_TASKS                           3
 #define SYS_TASK_SEND                           0
 #define SYS_TASK_RECV                           1
+#define SYS_TASK_TELEMETRY                      2
+
+/* send full telemetry report every n reports */
+#define TELEMETRY_FULL_EVERY                    16
+/* send the report after n periods skipped by the busy queue */
+#define TELEMETRY_MAX_SKIPPED                   4
 
 static h2pca_status app = { 0 };
 
+/* the routes over the application context. the public routes pass &app */
+static esp_err_t h2pca_ctx_done(h2pca_status * ctx);
+static esp_err_t h2pca_ctx_om_add_msg_ex(h2pca_status * ctx, const char * kind, const char * target, cJSON * params,
+                                         h2pca_om_policy policy);
+static h2pca_state h2pca_ctx_locked_GET_STATES(h2pca_status * ctx);
+static bool h2pca_ctx_locked_CHK_STATE(h2pca_status * ctx, h2pca_state astate);
+static void h2pca_ctx_locked_SET_STATE(h2pca_status * ctx, h2pca_state astate);
+static void h2pca_ctx_locked_CLR_STATE(h2pca_status * ctx, h2pca_state astate);
+static void h2pca_ctx_locked_CLR_ALL_STATES(h2pca_status * ctx);
+
+/* outgoing message. data contains kind, target and params
+ * as zero-terminated strings */
+typedef struct h2pca_om_item_t
+{
+    struct h2pca_om_item_t * next;
+    uint16_t size;
+    /* length of kind and target - the coalesce key */
+    uint16_t key_len;
+    char data[];
+} h2pca_om_item;
+
+/* application state retained in RTC memory between deep sleeps */
+typedef struct h2pca_rtc_state_t
+{
+    uint32_t magic;
+    uint32_t wakeups;
+    h2pca_state states;
+    /* virtual clock at the moment of wakeup (in us) */
+    int64_t clock;
+    int64_t awake_time;
+    int32_t tasks_cnt;
+    int64_t deadlines[H2PCA_RTC_MAX_TASKS];
+    uint16_t om_cnt;
+    uint16_t om_len;
+    uint8_t om[H2PCA_RTC_OM_SIZE];
+} h2pca_rtc_state;
+
+static RTC_DATA_ATTR h2pca_rtc_state rtc_state = { 0 };
+
+/* last successful Wi-Fi connection params. retained between
+ * deep sleeps and software resets */
+typedef struct h2pca_wifi_cache_t
+{
+    uint32_t magic;
+    uint32_t cfg_hash;
+    uint8_t bssid[6];
+    uint8_t channel;
+    tcpip_adapter_ip_info_t ip_info;
+    tcpip_adapter_dns_info_t dns_info;
+    /* DHCP lease time (in s) and its expiry by the RTC clock
+     * (in us, 0 - unknown) */
+    uint32_t lease_time;
+    int64_t lease_expire;
+    uint32_t checksum;
+} h2pca_wifi_cache;
+
+static RTC_NOINIT_ATTR h2pca_wifi_cache wifi_cache;
+
+/* recently handled incoming msgs. ring of 64-bit fingerprints and
+ * counting bloom filter over their low halves */
+typedef struct h2pca_dedup_state_t
+{
+    uint32_t head;
+    uint64_t ring[H2PCA_DEDUP_RING_SIZE];
+    uint8_t filter[H2PCA_DEDUP_FILTER_SIZE];
+} h2pca_dedup_state;
+
+#ifndef CONFIG_H2PCA_NO_INMSGS
+static RTC_DATA_ATTR h2pca_dedup_state dedup_state = { 0 };
+#endif
+
+#ifdef CONFIG_WC_USE_IO_STREAMS
+/* media frames ring. frames are filled and uploaded in place */
+typedef enum {
+    FRAME_FREE = 0,
+    FRAME_FILLING,
+    FRAME_READY,
+    FRAME_SENDING
+} h2pca_frame_state;
+
+typedef struct h2pca_frame_slot_t
+{
+    uint8_t * data;
+    uint32_t len;
+    uint32_t seq;
+    /* the time of commit (in us) */
+    int64_t ts;
+    h2pca_frame_state state;
+} h2pca_frame_slot;
+
+typedef struct h2pca_frame_ring_t
+{
+    portMUX_TYPE lock;
+    uint8_t * block;
+    uint32_t frame_size;
+    uint32_t seq;
+    /* fps window */
+    int64_t window_start;
+    uint32_t window_frames;
+    int32_t cnt;
+    h2pca_frame_slot slots[];
+} h2pca_frame_ring;
+#endif
+
+/* standard error classification */
+static const h2pca_error_rule STD_ERROR_RULES[] = {
+    { REST_ERR_NO_SUCH_SESSION, H2PCA_RECOVER_REAUTH },
+    { REST_ERR_INTERNAL_UNK,    H2PCA_RECOVER_RETRY },
+    { REST_ERR_DATABASE_FAIL,   H2PCA_RECOVER_RETRY },
+};
+
 /* JSON-RPC device metadata */
 /* device's write char to identify */
 static const char * JSON_BLE_CHAR         =  "ble_char";
 
+/* memory accounting */
+
+typedef struct h2pca_stack_reg_t
+{
+    const char * name;
+    TaskHandle_t handle;
+    uint32_t stack_size;
+} h2pca_stack_reg;
+
+static portMUX_TYPE mem_lock = portMUX_INITIALIZER_UNLOCKED;
+static h2pca_stack_reg mem_stacks[H2PCA_MAX_STACKS] = { 0 };
+static int mem_stacks_cnt = 0;
+/* count of running stack scans. the task is not unregistered while
+ * its stack is scanned */
+static int mem_stacks_readers = 0;
+
+#ifdef CONFIG_H2PCA_MEM_ACCOUNTING
+static h2pca_mem_stat mem_stats[H2PCA_MEM_TAGS_CNT] = { 0 };
+
+static void __mem_account(h2pca_mem_tag tag, size_t sz, bool alloc) {
+    portENTER_CRITICAL(&mem_lock);
+    h2pca_mem_stat * stat = &(mem_stats[tag]);
+    if (alloc) {
+        stat->cur_bytes += sz;
+        stat->allocs++;
+        if (stat->cur_bytes > stat->peak_bytes)
+            stat->peak_bytes = stat->cur_bytes;
+    } else {
+        /* the block could be allocated before the accounting started */
+        stat->cur_bytes = (stat->cur_bytes > sz) ? (stat->cur_bytes - sz) : 0;
+    }
+    portEXIT_CRITICAL(&mem_lock);
+}
+
+static void * __mem_alloc(h2pca_mem_tag tag, size_t sz) {
+    void * ptr = malloc(sz);
+    if (ptr != NULL)
+        __mem_account(tag, heap_caps_get_allocated_size(ptr), true);
+    return ptr;
+}
+
+static void * __mem_calloc(h2pca_mem_tag tag, size_t n, size_t sz) {
+    void * ptr = calloc(n, sz);
+    if (ptr != NULL)
+        __mem_account(tag, heap_caps_get_allocated_size(ptr), true);
+    return ptr;
+}
+
+static void * __mem_realloc(h2pca_mem_tag tag, void * ptr, size_t sz) {
+    size_t old_sz = (ptr != NULL) ? heap_caps_get_allocated_size(ptr) : 0;
+    void * new_ptr = realloc(ptr, sz);
+    if (new_ptr != NULL) {
+        __mem_account(tag, old_sz, false);
+        __mem_account(tag, heap_caps_get_allocated_size(new_ptr), true);
+    }
+    return new_ptr;
+}
+
+static void * __mem_alloc_caps(h2pca_mem_tag tag, size_t sz, uint32_t caps) {
+    void * ptr = heap_caps_malloc(sz, caps);
+    if (ptr != NULL)
+        __mem_account(tag, heap_caps_get_allocated_size(ptr), true);
+    return ptr;
+}
+
+static void __mem_free(h2pca_mem_tag tag, void * ptr) {
+    if (ptr == NULL) return;
+    __mem_account(tag, heap_caps_get_allocated_size(ptr), false);
+    free(ptr);
+}
+
+static void * __json_malloc(size_t sz) {
+    return __mem_alloc(H2PCA_MEM_JSON, sz);
+}
+
+static void __json_free(void * ptr) {
+    __mem_free(H2PCA_MEM_JSON, ptr);
+}
+#else
+#define __mem_alloc(tag, sz)        malloc(sz)
+#define __mem_calloc(tag, n, sz)    calloc(n, sz)
+#define __mem_realloc(tag, ptr, sz) realloc(ptr, sz)
+#define __mem_alloc_caps(tag, sz, caps) heap_caps_malloc(sz, caps)
+#define __mem_free(tag, ptr)        free(ptr)
+#endif
+
+/* trace ring buffer */
+
+#ifdef CONFIG_H2PCA_TRACE
+#if (CONFIG_H2PCA_TRACE_SIZE & (CONFIG_H2PCA_TRACE_SIZE - 1)) != 0
+#error "CONFIG_H2PCA_TRACE_SIZE must be a power of two"
+#endif
+
+static h2pca_trace_event trace_buf[CONFIG_H2PCA_TRACE_SIZE] = { 0 };
+static uint32_t trace_head = 0;
+
+/* lock-free. safe to call from any task or timer callback */
+static void __trace(uint16_t type, uint16_t id, uint32_t arg) {
+    uint32_t seq = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    h2pca_trace_event * ev = &(trace_buf[seq & (CONFIG_H2PCA_TRACE_SIZE - 1)]);
+
+    __atomic_store_n(&(ev->seq), 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ev->ts = (uint32_t) esp_timer_get_time();
+    ev->type = type;
+    ev->id = id;
+    ev->arg = arg;
+    __atomic_store_n(&(ev->seq), seq + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACE(type, id, arg) __trace((type), (id), (arg))
+#else
+#define TRACE(type, id, arg)
+#endif
+
+#define TRACE_PHASE_BEGIN(ph) TRACE(H2PCA_TRACE_PHASE_BEGIN, ph, 0)
+#define TRACE_PHASE_END(ph)   TRACE(H2PCA_TRACE_PHASE_END, ph, 0)
+
+/* main loop phases. traced and timed */
+static inline void __phase_begin(h2pca_status * ctx, uint16_t ph) {
+    TRACE_PHASE_BEGIN(ph);
+    ctx->phase_start[ph] = esp_timer_get_time();
+}
+
+/* returns the duration of the phase (in us) */
+static inline uint32_t __phase_end(h2pca_status * ctx, uint16_t ph) {
+    uint32_t dur = (uint32_t)(esp_timer_get_time() - ctx->phase_start[ph]);
+    h2pca_phase_stat * stat = &(ctx->phase_stats[ph]);
+
+    stat->cnt++;
+    stat->sum += dur;
+    if (dur > stat->max)
+        stat->max = dur;
+    TRACE_PHASE_END(ph);
+
+    return dur;
+}
+
+/* callbacks */
+
+#ifdef CONFIG_H2PCA_STATIC_HOOKS
+/* hooks are bound at compile time. not bound hooks are compiled out */
+#include CONFIG_H2PCA_HOOKS_HEADER
+
+#ifndef H2PCA_HOOK_on_wifi_init
+#define H2PCA_HOOK_on_wifi_init()
+#endif
+#ifndef H2PCA_HOOK_on_wifi_con
+#define H2PCA_HOOK_on_wifi_con()
+#endif
+#ifndef H2PCA_HOOK_on_wifi_dis
+#define H2PCA_HOOK_on_wifi_dis()
+#endif
+#ifndef H2PCA_HOOK_on_connect
+#define H2PCA_HOOK_on_connect()
+#endif
+#ifndef H2PCA_HOOK_on_auth
+#define H2PCA_HOOK_on_auth(sid)
+#endif
+#ifndef H2PCA_HOOK_on_error
+#define H2PCA_HOOK_on_error(err)
+#endif
+#ifndef H2PCA_HOOK_on_disconnect
+#define H2PCA_HOOK_on_disconnect()
+#endif
+#ifndef H2PCA_HOOK_on_read_nvs
+#define H2PCA_HOOK_on_read_nvs(handle)
+#endif
+#ifndef H2PCA_HOOK_on_init_cfg
+#define H2PCA_HOOK_on_init_cfg(json_cfg)
+#endif
+#ifndef H2PCA_HOOK_on_ble_cfg_start
+#define H2PCA_HOOK_on_ble_cfg_start()
+#endif
+#ifndef H2PCA_HOOK_on_ble_cfg_finished
+#define H2PCA_HOOK_on_ble_cfg_finished()
+#endif
+#ifndef H2PCA_HOOK_on_begin_loop
+#define H2PCA_HOOK_on_begin_loop()
+#endif
+#ifndef H2PCA_HOOK_on_begin_step
+#define H2PCA_HOOK_on_begin_step()
+#endif
+#ifndef H2PCA_HOOK_on_before_inmsgs
+#define H2PCA_HOOK_on_before_inmsgs()
+#endif
+#ifndef H2PCA_HOOK_on_after_inmsgs
+#define H2PCA_HOOK_on_after_inmsgs()
+#endif
+#ifndef H2PCA_HOOK_on_finish_step
+#define H2PCA_HOOK_on_finish_step()
+#endif
+#ifndef H2PCA_HOOK_on_finish_loop
+#define H2PCA_HOOK_on_finish_loop()
+#endif
+#ifndef H2PCA_HOOK_on_om_high
+#define H2PCA_HOOK_on_om_high()
+#endif
+#ifndef H2PCA_HOOK_on_om_low
+#define H2PCA_HOOK_on_om_low()
+#endif
+
+#define EXEC_CB(cb, ...) H2PCA_HOOK_##cb(__VA_ARGS__)
+#else
+#define EXEC_CB(cb, ...) if (ctx->cfg->cb != NULL) \
+                                ctx->cfg->cb(__VA_ARGS__);
+#endif
+
 static void __set_error(esp_err_t * error, esp_err_t erv) {
     if (error != NULL)
         *error = erv;
 }
 
+static uint32_t __fnv1a(uint32_t hash, const void * data, size_t len) {
+    const uint8_t * p = (const uint8_t *)data;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
 h2pca_task * h2pca_new_task(const char * TAG, h2pca_task_id ID, void * user_data, esp_err_t * error) {
-    h2pca_task * tsk = (h2pca_task *)malloc(sizeof(h2pca_task));
+    h2pca_task * tsk = (h2pca_task *)__mem_alloc(H2PCA_MEM_TASKS, sizeof(h2pca_task));
 
     if (tsk == NULL) {
         __set_error(error, ESP_ERR_NO_MEM);
@@ -83,36 +468,61 @@ h2pca_task * h2pca_new_task(const char * TAG, h2pca_task_id ID, void * user_data
 esp_err_t h2pca_done_task(h2pca_task * tsk) {
     if (tsk == NULL) return ESP_ERR_INVALID_ARG;
 
-    free(tsk);
+    __mem_free(H2PCA_MEM_TASKS, tsk);
 
     return ESP_OK;
 }
 
 h2pca_tasks * h2pca_new_task_pool(esp_err_t * error) {
-    h2pca_tasks * pool = (h2pca_tasks*)malloc(sizeof(h2pca_tasks));
+    h2pca_tasks * pool = (h2pca_tasks*)__mem_alloc(H2PCA_MEM_TASKS, sizeof(h2pca_tasks));
 
     if (pool == NULL) {
         __set_error(error, ESP_ERR_NO_MEM);
         return NULL;
     }
 
-    pool->cnt = 0;
-    pool->tasks = NULL;
+    memset(pool, 0, sizeof(h2pca_tasks));
 
     return pool;
 }
 
+#define POOL_TASK(pool, i) (((pool)->block != NULL) ? &((pool)->block[i]) : (pool)->tasks[i])
+
+/* add the task index to the ID map */
+static esp_err_t __task_pool_map_id(h2pca_tasks * pool, h2pca_task_id ID, int32_t idx) {
+    /* the index fits into the map value or the task is found by index */
+    if ((ID >= H2PCA_TASK_ID_MAP_MAX) || (idx >= UINT8_MAX) || (ID == (h2pca_task_id)idx))
+        return ESP_OK;
+
+    if (ID >= pool->id_map_sz) {
+        uint8_t * id_map = (uint8_t *) __mem_realloc(H2PCA_MEM_TASKS, pool->id_map, ID + 1);
+        if (id_map == NULL) return ESP_ERR_NO_MEM;
+        memset(&(id_map[pool->id_map_sz]), 0, ID + 1 - pool->id_map_sz);
+        pool->id_map = id_map;
+        pool->id_map_sz = ID + 1;
+    }
+    pool->id_map[ID] = (uint8_t)(idx + 1);
+
+    return ESP_OK;
+}
+
 esp_err_t h2pca_task_pool_add_task(h2pca_tasks * pool, h2pca_task * tsk) {
     if (pool == NULL) return ESP_ERR_INVALID_ARG;
     if (tsk == NULL) return ESP_ERR_INVALID_ARG;
+    if (pool->block != NULL) return ESP_ERR_INVALID_STATE;
 
-    if (pool->tasks == NULL) {
-        pool->tasks = (h2pca_task **) malloc(sizeof(h2pca_tasks*));
-    } else {
-        pool->tasks = (h2pca_task **) realloc(pool->tasks, sizeof(h2pca_tasks*) * (pool->cnt+1));
+    if (pool->cnt >= pool->capacity) {
+        int32_t capacity = (pool->capacity > 0) ? (pool->capacity << 1) : TASK_POOL_INIT_CAPACITY;
+        h2pca_task ** tasks = (h2pca_task **) __mem_realloc(H2PCA_MEM_TASKS, pool->tasks,
+                                                            sizeof(h2pca_task *) * capacity);
+        if (tasks == NULL) return ESP_ERR_NO_MEM;
+
+        pool->tasks = tasks;
+        pool->capacity = capacity;
     }
 
-    if (pool->tasks == NULL) return ESP_ERR_NO_MEM;
+    esp_err_t err = __task_pool_map_id(pool, tsk->ID, pool->cnt);
+    if (err != ESP_OK) return err;
 
     pool->tasks[pool->cnt] = tsk;
     pool->cnt++;
@@ -120,6 +530,81 @@ esp_err_t h2pca_task_pool_add_task(h2pca_tasks * pool, h2pca_task * tsk) {
     return ESP_OK;
 }
 
+esp_err_t h2pca_task_pool_bind_table(h2pca_tasks * pool, const h2pca_task_def * defs,
+                                     h2pca_task * block, int32_t cnt) {
+    if ((pool == NULL) || (defs == NULL) || (block == NULL) || (cnt <= 0))
+        return ESP_ERR_INVALID_ARG;
+    if ((pool->cnt > 0) || (pool->block != NULL)) return ESP_ERR_INVALID_STATE;
+
+    memset(block, 0, sizeof(h2pca_task) * cnt);
+
+    for (int32_t i = 0; i < cnt; ++i) {
+        const h2pca_task_def * def = &(defs[i]);
+        h2pca_task * tsk = &(block[i]);
+
+        tsk->TAG = def->TAG;
+        tsk->ID = def->ID;
+        tsk->period = def->period;
+        tsk->req_bitmask = def->req_bitmask;
+        tsk->apply_bitmask = def->apply_bitmask;
+        tsk->on_time = def->on_time;
+        tsk->on_sync = def->on_sync;
+        tsk->user_data = def->user_data;
+        tsk->mode = def->mode;
+        tsk->exec = def->exec;
+        tsk->priority = def->priority;
+        tsk->sync_deadline = def->sync_deadline;
+
+        esp_err_t err = __task_pool_map_id(pool, tsk->ID, i);
+        if (err != ESP_OK) {
+            __mem_free(H2PCA_MEM_TASKS, pool->id_map);
+            pool->id_map = NULL;
+            pool->id_map_sz = 0;
+            return err;
+        }
+    }
+
+    pool->block = block;
+    pool->cnt = cnt;
+
+    return ESP_OK;
+}
+
+h2pca_task * h2pca_task_pool_get_at(h2pca_tasks * pool, int32_t idx) {
+    if ((pool == NULL) || (idx < 0) || (idx >= pool->cnt)) return NULL;
+
+    return POOL_TASK(pool, idx);
+}
+
+int32_t h2pca_task_pool_index_of(h2pca_tasks * pool, h2pca_task_id ID) {
+    if (pool == NULL) return -1;
+
+    /* the ID is equal to the index */
+    if ((ID < (h2pca_task_id)pool->cnt) && (POOL_TASK(pool, ID)->ID == ID))
+        return (int32_t)ID;
+
+    if (ID < pool->id_map_sz) {
+        if (pool->id_map[ID] > 0)
+            return pool->id_map[ID] - 1;
+    }
+
+    if ((ID < H2PCA_TASK_ID_MAP_MAX) && (pool->cnt < UINT8_MAX))
+        return -1;
+
+    for (int32_t i = 0; i < pool->cnt; ++i) {
+        if (POOL_TASK(pool, i)->ID == ID)
+            return i;
+    }
+
+    return -1;
+}
+
+h2pca_task * h2pca_task_pool_find(h2pca_tasks * pool, h2pca_task_id ID) {
+    int32_t idx = h2pca_task_pool_index_of(pool, ID);
+
+    return (idx >= 0) ? POOL_TASK(pool, idx) : NULL;
+}
+
 esp_err_t h2pca_release_task_pool(h2pca_tasks * tsks) {
     if (tsks == NULL) return ESP_ERR_INVALID_ARG;
 
@@ -127,373 +612,2283 @@ esp_err_t h2pca_release_task_pool(h2pca_tasks * tsks) {
         for (int i = 0; i < tsks->cnt; ++i) {
             h2pca_done_task(tsks->tasks[i]);
         }
-        free(tsks->tasks);
+        __mem_free(H2PCA_MEM_TASKS, tsks->tasks);
         tsks->tasks = NULL;
     }
+    if (tsks->id_map != NULL) {
+        __mem_free(H2PCA_MEM_TASKS, tsks->id_map);
+        tsks->id_map = NULL;
+    }
+    /* static block is not released */
+    tsks->block = NULL;
     tsks->cnt = 0;
+    tsks->capacity = 0;
+    tsks->id_map_sz = 0;
 
     return ESP_OK;
 }
 
-esp_err_t h2pca_init_cfg(h2pca_config * cfg) {
-    if (cfg == NULL) return ESP_ERR_INVALID_ARG;
+/* outgoing messages queue */
 
-    memset(cfg, 0x00, sizeof(h2pca_config));
+static h2pca_om_item * __om_new_item(const char * kind, const char * target, const char * params) {
+    size_t klen = strlen(kind) + 1;
+    size_t tlen = (target != NULL) ? (strlen(target) + 1) : 1;
+    size_t plen = (params != NULL) ? (strlen(params) + 1) : 1;
 
-    cfg->recv_msgs_period = GET_MSG_TIMER_DELTA;
-    cfg->send_msgs_period = SEND_MSG_TIMER_DELTA;
-    cfg->main_loop_period = MAIN_TASK_LOOP_DELAY;
+    if ((klen + tlen + plen) > UINT16_MAX) return NULL;
 
-    cfg->inmsgs_proceed_chunk = STD_MSGS_CHUNK_SZ;
+    h2pca_om_item * item = (h2pca_om_item *)__mem_alloc(H2PCA_MEM_APP, sizeof(h2pca_om_item) + klen + tlen + plen);
+    if (item == NULL) return NULL;
 
-    cfg->h2pcmode = H2PC_MODE_MESSAGING;
+    item->next = NULL;
+    item->size = (uint16_t)(klen + tlen + plen);
+    item->key_len = (uint16_t)(klen + tlen);
 
-    h2pca_ble_config_init_standard(&(cfg->ble_cfg));
+    char * dst = item->data;
+    memcpy(dst, kind, klen);
+    dst += klen;
+    if (target != NULL) memcpy(dst, target, tlen); else *dst = 0;
+    dst += tlen;
+    if (params != NULL) memcpy(dst, params, plen); else *dst = 0;
 
-    return ESP_OK;
+    return item;
 }
 
-h2pca_status * h2pca_init(h2pca_config * cfg, esp_err_t* error) {
-    if (cfg == NULL) {
-        __set_error(error, ESP_ERR_INVALID_ARG);
-        return NULL;
+static void __om_push(h2pca_status * ctx, h2pca_om_item * item) {
+    portENTER_CRITICAL(&(ctx->om_lock));
+    if (ctx->om_last != NULL)
+        ctx->om_last->next = item;
+    else
+        ctx->om_first = item;
+    ctx->om_last = item;
+    ctx->om_cnt++;
+    ctx->om_bytes += item->size;
+    portEXIT_CRITICAL(&(ctx->om_lock));
+}
+
+/* pop the first item if it is not bigger than max_size */
+static h2pca_om_item * __om_pop_max(h2pca_status * ctx, uint32_t max_size) {
+    portENTER_CRITICAL(&(ctx->om_lock));
+    h2pca_om_item * item = ctx->om_first;
+    if ((item != NULL) && (item->size > max_size))
+        item = NULL;
+    if (item != NULL) {
+        ctx->om_first = item->next;
+        if (ctx->om_first == NULL)
+            ctx->om_last = NULL;
+        ctx->om_cnt--;
+        ctx->om_bytes -= item->size;
+    }
+    portEXIT_CRITICAL(&(ctx->om_lock));
+    return item;
+}
+
+static h2pca_om_item * __om_pop(h2pca_status * ctx) {
+    return __om_pop_max(ctx, UINT32_MAX);
+}
+
+static void __om_free_list(h2pca_om_item * item) {
+    while (item != NULL) {
+        h2pca_om_item * next = item->next;
+        __mem_free(H2PCA_MEM_APP, item);
+        item = next;
     }
+}
 
-    memset(&app, 0, sizeof(h2pca_status));
+/* watermarks. locked by caller */
 
-    app.cfg = cfg;
-    app.client_state = xEventGroupCreate();
+/* the queue can not grow by the given msgs and bytes without eviction */
+static bool __om_full(h2pca_status * ctx, int32_t msgs, uint32_t size) {
+    h2pca_config * cfg = ctx->cfg;
 
-    esp_err_t err = nvs_flash_init();
-    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        err = nvs_flash_erase();
-        if (err != ESP_OK) {
-            __set_error(error, err);
-            h2pca_done();
-            return NULL;
+    return ((cfg->om_high_msgs > 0) && (ctx->om_cnt + ctx->om_h2pc_cnt + msgs > cfg->om_high_msgs)) ||
+           ((cfg->om_high_bytes > 0) && (ctx->om_bytes + ctx->om_h2pc_bytes + size > cfg->om_high_bytes));
+}
+
+/* is the queue at or below the low watermarks. not bounded queue is
+ * always low */
+static bool __om_low(h2pca_status * ctx) {
+    h2pca_config * cfg = ctx->cfg;
+    int32_t low_msgs = (cfg->om_low_msgs > 0) ? cfg->om_low_msgs : (cfg->om_high_msgs >> 1);
+    uint32_t low_bytes = (cfg->om_low_bytes > 0) ? cfg->om_low_bytes : (cfg->om_high_bytes >> 1);
+
+    return ((cfg->om_high_msgs == 0) || (ctx->om_cnt + ctx->om_h2pc_cnt <= low_msgs)) &&
+           ((cfg->om_high_bytes == 0) || (ctx->om_bytes + ctx->om_h2pc_bytes <= low_bytes));
+}
+
+/* returns 1 if the high watermark is reached, -1 if the queue fell to
+ * the low watermark, 0 otherwise */
+static int __om_check_pressure(h2pca_status * ctx, bool forced) {
+    if (!ctx->om_pressure) {
+        /* the high watermark is reached if no room for one more byte */
+        if (forced || __om_full(ctx, 1, 1)) {
+            ctx->om_pressure = true;
+            return 1;
         }
-        err = nvs_flash_init();
+    } else
+    if (__om_low(ctx)) {
+        ctx->om_pressure = false;
+        return -1;
     }
-    if (err != ESP_OK) {
-        __set_error(error, err);
-        h2pca_done();
-        return NULL;
+    return 0;
+}
+
+static void __om_notify_pressure(h2pca_status * ctx, int ev) {
+    if (ev > 0) {
+        TRACE(H2PCA_TRACE_OM_PRESSURE, 1, ctx->om_cnt);
+        ESP_LOGW(ctx->cfg->LOG_TAG, "Outgoing queue is full: %" PRId32 " msgs, %" PRIu32 " bytes", ctx->om_cnt, ctx->om_bytes);
+        EXEC_CB(on_om_high);
+    } else
+    if (ev < 0) {
+        TRACE(H2PCA_TRACE_OM_PRESSURE, 0, ctx->om_cnt);
+        EXEC_CB(on_om_low);
     }
+}
 
-    /* generate mac address and device metadata */
-    uint8_t sta_mac[6];
-    err = esp_efuse_mac_get_default(sta_mac);
-    if (err != ESP_OK) {
-        __set_error(error, err);
-        h2pca_done();
-        return NULL;
+static void __om_clear(h2pca_status * ctx) {
+    h2pca_om_item * item;
+    while ((item = __om_pop(ctx)) != NULL)
+        __mem_free(H2PCA_MEM_APP, item);
+}
+
+/* push the item with the given policy. returns the items to free
+ * in \a victims */
+static esp_err_t __om_push_policy(h2pca_status * ctx, h2pca_om_item * item, h2pca_om_policy policy,
+                                  h2pca_om_item ** victims, int * pressure_ev) {
+    esp_err_t res = ESP_OK;
+    bool forced = false;
+
+    *victims = NULL;
+    *pressure_ev = 0;
+
+    /* the msg never fits the queue. reject it before any eviction */
+    if ((ctx->cfg->om_high_bytes > 0) && (item->size > ctx->cfg->om_high_bytes)) {
+        portENTER_CRITICAL(&(ctx->om_lock));
+        ctx->om_shed++;
+        portEXIT_CRITICAL(&(ctx->om_lock));
+        return ESP_ERR_INVALID_SIZE;
     }
 
-    for (int i = 0; i < 6; i++) {
-        app.mac_str[i<<1] = UPPER_XDIGITS[(sta_mac[i] >> 4) & 0x0f];
-        app.mac_str[(i<<1) + 1] = UPPER_XDIGITS[(sta_mac[i] & 0x0f)];
+    portENTER_CRITICAL(&(ctx->om_lock));
+    if (policy == H2PCA_OM_COALESCE) {
+        h2pca_om_item * prev = NULL;
+        h2pca_om_item * cur = ctx->om_first;
+        while ((cur != NULL) &&
+               ((cur->key_len != item->key_len) || (memcmp(cur->data, item->data, item->key_len) != 0))) {
+            prev = cur;
+            cur = cur->next;
+        }
+        if (cur != NULL) {
+            if (!__om_full(ctx, 0, (item->size > cur->size) ? (item->size - cur->size) : 0)) {
+                /* replace in place to keep the position of the msg */
+                item->next = cur->next;
+                if (prev != NULL) prev->next = item; else ctx->om_first = item;
+                if (ctx->om_last == cur) ctx->om_last = item;
+                ctx->om_bytes = ctx->om_bytes - cur->size + item->size;
+                cur->next = NULL;
+                *victims = cur;
+                ctx->om_coalesced++;
+                item = NULL;
+            }
+        }
     }
 
-    app.mac_str[12] = 0;
+    if ((item != NULL) && __om_full(ctx, 1, item->size)) {
+        forced = true;
+        if (policy == H2PCA_OM_KEEP) {
+            /* evict the oldest msgs */
+            h2pca_om_item * last_victim = NULL;
+            while ((ctx->om_first != NULL) && __om_full(ctx, 1, item->size)) {
+                h2pca_om_item * old = ctx->om_first;
+                ctx->om_first = old->next;
+                ctx->om_cnt--;
+                ctx->om_bytes -= old->size;
+                old->next = NULL;
+                if (last_victim != NULL) last_victim->next = old; else *victims = old;
+                last_victim = old;
+                ctx->om_evicted++;
+            }
+            if (ctx->om_first == NULL)
+                ctx->om_last = NULL;
+        } else {
+            ctx->om_shed++;
+            res = ESP_FAIL;
+        }
+    }
 
-    memset(app.device_char, '0', 4);
+    if ((item != NULL) && (res == ESP_OK)) {
+        if (ctx->om_last != NULL)
+            ctx->om_last->next = item;
+        else
+            ctx->om_first = item;
+        ctx->om_last = item;
+        ctx->om_cnt++;
+        ctx->om_bytes += item->size;
+        if (ctx->om_cnt > ctx->om_peak)
+            ctx->om_peak = ctx->om_cnt;
+    }
+    *pressure_ev = __om_check_pressure(ctx, forced);
+    portEXIT_CRITICAL(&(ctx->om_lock));
 
-    app.device_char[4] = UPPER_XDIGITS[(uint8_t)((CONFIG_WC_DEVICE_CHAR1_UUID >> 12) & 0x000f)];
-    app.device_char[5] = UPPER_XDIGITS[(uint8_t)((CONFIG_WC_DEVICE_CHAR1_UUID >> 8) & 0x000f)];
-    app.device_char[6] = UPPER_XDIGITS[(uint8_t)((CONFIG_WC_DEVICE_CHAR1_UUID >> 4) & 0x000f)];
-    app.device_char[7] = UPPER_XDIGITS[(uint8_t)((CONFIG_WC_DEVICE_CHAR1_UUID) & 0x000f)];
+    return res;
+}
 
-    if (app.cfg->device_meta_data == NULL)
-        app.cfg->device_meta_data = cJSON_CreateObject();
-    cJSON_AddItemToObject(app.cfg->device_meta_data, JSON_BLE_CHAR, cJSON_CreateStringReference(app.device_char));
+/* send pacing. token buckets for msgs and bytes */
 
-    return &app;
+static void __send_bucket_refill(h2pca_status * ctx) {
+    h2pca_config * cfg = ctx->cfg;
+    int64_t now = esp_timer_get_time();
+    int64_t elapsed = now - ctx->send_refill_at;
+
+    ctx->send_refill_at = now;
+    if (elapsed <= 0) return;
+
+    ctx->send_tokens_msgs = h2pca_bucket_refill(ctx->send_tokens_msgs, elapsed, cfg->send_rate_msgs,
+                                                cfg->send_burst_msgs, ctx->send_rate_scale);
+    ctx->send_tokens_bytes = h2pca_bucket_refill(ctx->send_tokens_bytes, elapsed, cfg->send_rate_bytes,
+                                                 cfg->send_burst_bytes, ctx->send_rate_scale);
 }
 
-esp_err_t h2pca_ble_config_init(h2pca_ble_config * cfg, int count, const char ** cfg_field, uint8_t * cfg_id) {
-    if (cfg == NULL) return ESP_ERR_INVALID_ARG;
+/* start with a random share of the burst to spread the load of
+ * devices reconnected together */
+static void __send_bucket_reset(h2pca_status * ctx) {
+    uint32_t share = esp_random() % H2PCA_RATE_SCALE_FULL;
 
+    ctx->send_tokens_msgs = (int64_t) ctx->cfg->send_burst_msgs * H2PCA_TOKEN_UNIT / H2PCA_RATE_SCALE_FULL * share;
+    ctx->send_tokens_bytes = (int64_t) ctx->cfg->send_burst_bytes * H2PCA_TOKEN_UNIT / H2PCA_RATE_SCALE_FULL * share;
+    ctx->send_refill_at = esp_timer_get_time();
+}
 
-    cfg->count = count;
-    cfg->ids = cfg_field;
-    cfg->cfgs = cfg_id;
+/* pass the next batch of waiting messages to the h2pc client.
+ * the batch left in the h2pc client after a failed send is resent
+ * alone, the next one is passed after it is sent.
+ * returns the count of messages in the batch */
+static uint32_t __om_flush(h2pca_status * ctx) {
+    h2pca_om_item * item;
+    uint32_t batch_msgs = 0;
+    uint32_t batch_bytes = 0;
+
+    __send_bucket_refill(ctx);
+
+    while (!h2pc_om_locked_waiting()) {
+        uint32_t max_size = h2pca_bucket_allowed(ctx->send_tokens_msgs, ctx->send_tokens_bytes,
+                                                 ctx->cfg->send_rate_msgs, ctx->cfg->send_rate_bytes,
+                                                 ctx->cfg->send_burst_bytes);
+        if ((max_size == 0) || ((item = __om_pop_max(ctx, max_size)) == NULL))
+            break;
+
+        h2pca_bucket_take(&(ctx->send_tokens_msgs), &(ctx->send_tokens_bytes),
+                          ctx->cfg->send_rate_msgs, ctx->cfg->send_rate_bytes, item->size);
+        batch_msgs++;
+        batch_bytes += item->size;
+
+        const char * kind = item->data;
+        const char * target = kind + strlen(kind) + 1;
+        const char * params = target + strlen(target) + 1;
+
+        cJSON * jparams = (*params) ? cJSON_Parse(params) : NULL;
+        h2pc_om_add_msg(kind, (*target) ? target : NULL, jparams);
+
+        __mem_free(H2PCA_MEM_APP, item);
+    }
 
-    return ESP_OK;
+    portENTER_CRITICAL(&(ctx->om_lock));
+    ctx->om_h2pc_cnt += batch_msgs;
+    ctx->om_h2pc_bytes += batch_bytes;
+    int ev = __om_check_pressure(ctx, false);
+    portEXIT_CRITICAL(&(ctx->om_lock));
+
+    __om_notify_pressure(ctx, ev);
+
+    if (batch_msgs > 0) {
+        ctx->batches++;
+        ctx->batch_last_msgs = batch_msgs;
+        ctx->batch_last_bytes = batch_bytes;
+        if (batch_msgs > ctx->batch_max_msgs)
+            ctx->batch_max_msgs = batch_msgs;
+        if (batch_bytes > ctx->batch_max_bytes)
+            ctx->batch_max_bytes = batch_bytes;
+    }
+
+    return batch_msgs;
 }
 
-esp_err_t h2pca_ble_config_init_standard(h2pca_ble_config * cfg) {
-    if (cfg == NULL) return ESP_ERR_INVALID_ARG;
+/* the batch passed to the h2pc client is sent or dropped */
+static void __om_h2pc_done(h2pca_status * ctx) {
+    portENTER_CRITICAL(&(ctx->om_lock));
+    ctx->om_h2pc_cnt = 0;
+    ctx->om_h2pc_bytes = 0;
+    int ev = __om_check_pressure(ctx, false);
+    portEXIT_CRITICAL(&(ctx->om_lock));
 
-    cfg->count = get_ble_std_config_count();
-    cfg->ids = get_ble_std_config_idstr();
-    cfg->cfgs = get_ble_std_config_idkey();
+    __om_notify_pressure(ctx, ev);
+}
 
-    return ESP_OK;
+static esp_err_t h2pca_ctx_om_add_msg(h2pca_status * ctx, const char * kind, const char * target, cJSON * params) {
+    return h2pca_ctx_om_add_msg_ex(ctx, kind, target, params, H2PCA_OM_KEEP);
 }
 
-#define EXEC_CB(cb, ...) if (app.cfg->cb != NULL) \
-                                app.cfg->cb(__VA_ARGS__);
+static esp_err_t h2pca_ctx_om_add_msg_ex(h2pca_status * ctx, const char * kind, const char * target, cJSON * params,
+                                  h2pca_om_policy policy) {
+    if ((ctx == NULL) || (kind == NULL)) {
+        if (params != NULL) cJSON_Delete(params);
+        return ESP_ERR_INVALID_ARG;
+    }
 
+    char * params_str = NULL;
+    if (params != NULL) {
+        params_str = cJSON_PrintUnformatted(params);
+        cJSON_Delete(params);
+        if (params_str == NULL) return ESP_ERR_NO_MEM;
+    }
 
-static void set_time(void)
-{
-    struct timeval tv = {
-        .tv_sec = 1509449941,
-    };
-    struct timezone tz;
-    memset(&tz, 0, sizeof(tz));
-    settimeofday(&tv, &tz);
+    h2pca_om_item * item = __om_new_item(kind, target, params_str);
+    if (params_str != NULL) cJSON_free(params_str);
 
-    /* Start SNTP service */
-    sntp_setoperatingmode(SNTP_OPMODE_POLL);
-    sntp_init();
-}
+    if (item == NULL) return ESP_ERR_NO_MEM;
 
-/* disconnect from host. reset all states */
-static void __disconnect_host() {
-    if (h2pca_locked_CHK_STATE(HOST_CONNECTED_BIT))
-        h2pc_disconnect_http2();
-    else
-        h2pc_reset_buffers();
-    h2pca_locked_CLR_ALL_STATES();
+    h2pca_om_item * victims;
+    int ev;
+    esp_err_t res = __om_push_policy(ctx, item, policy, &victims, &ev);
 
-    EXEC_CB(on_disconnect);
-}
+    if (res != ESP_OK)
+        __mem_free(H2PCA_MEM_APP, item);
+    __om_free_list(victims);
 
-static void __check_h2pc_errors() {
-    if (h2pca_locked_CHK_STATE(WIFI_CONNECTED_BIT|HOST_CONNECTED_BIT)) {
-        if (h2pc_get_connected()) {
-            if (h2pc_get_protocol_errors_cnt() > 0) {
-                int err = h2pc_get_last_error();
+    __om_notify_pressure(ctx, ev);
 
-                if (err != REST_RESULT_OK)
-                    EXEC_CB(on_error, err);
+    return res;
+}
 
-                if (err == REST_ERR_NO_SUCH_SESSION) {
-                    h2pca_locked_CLR_STATE(AUTHORIZED_BIT);
-                    h2pca_locked_SET_STATE(MODE_AUTH);
-                } else
-                    __disconnect_host();
-            }
-        } else {
-            __disconnect_host();
-        }
-    }
+static int32_t h2pca_ctx_om_count(h2pca_status * ctx) {
+    return ctx->om_cnt;
 }
 
-/* connect to host */
-static void __connect_to_http2() {
-    __disconnect_host();
+#ifdef CONFIG_WC_USE_IO_STREAMS
+/* media frames streaming */
+
+static esp_err_t __stream_init(h2pca_status * ctx) {
+    int32_t cnt = ctx->cfg->stream_frames_cnt;
+    if (cnt == 0) return ESP_OK;
+
+    h2pca_frame_ring * ring = __mem_calloc(H2PCA_MEM_FRAMES, 1,
+                                           sizeof(h2pca_frame_ring) + sizeof(h2pca_frame_slot) * cnt);
+    if (ring == NULL) return ESP_ERR_NO_MEM;
+
+    size_t block_sz = (size_t) ctx->cfg->stream_frame_size * cnt;
+    if (ctx->cfg->stream_use_psram)
+        ring->block = __mem_alloc_caps(H2PCA_MEM_FRAMES, block_sz, MALLOC_CAP_SPIRAM);
+    if (ring->block == NULL)
+        ring->block = __mem_alloc_caps(H2PCA_MEM_FRAMES, block_sz, MALLOC_CAP_8BIT);
+    if (ring->block == NULL) {
+        __mem_free(H2PCA_MEM_FRAMES, ring);
+        return ESP_ERR_NO_MEM;
+    }
 
-    char * addr;
-    if (WC_CFG_VALUES != NULL)
-        addr = get_cfg_value(CFG_HOST_NAME);
-    else
-        addr = HTTP2_SERVER_URI;
+    vPortCPUInitializeMutex(&(ring->lock));
+    ring->frame_size = ctx->cfg->stream_frame_size;
+    ring->cnt = cnt;
+    ring->window_start = esp_timer_get_time();
+    for (int i = 0; i < cnt; ++i)
+        ring->slots[i].data = ring->block + ((size_t) ring->frame_size * i);
 
-    if (h2pc_connect_to_http2(addr)) {
-        app.connect_errors = 0;
+    ctx->frames = ring;
 
-        h2pca_locked_SET_STATE(HOST_CONNECTED_BIT | MODE_AUTH);
+    return ESP_OK;
+}
 
-        EXEC_CB(on_connect);
-    } else
-        app.connect_errors++;
+static void __stream_done(h2pca_status * ctx) {
+    if (ctx->frames == NULL) return;
+
+    __mem_free(H2PCA_MEM_FRAMES, ctx->frames->block);
+    __mem_free(H2PCA_MEM_FRAMES, ctx->frames);
+    ctx->frames = NULL;
 }
 
-static void __send_authorize() {
-    ESP_LOGI(app.cfg->LOG_TAG, "Trying to authorize");
+static h2pca_frame_slot * __stream_slot_of(h2pca_frame_ring * ring, const uint8_t * frame) {
+    if ((frame < ring->block) || (frame >= ring->block + ((size_t) ring->frame_size * ring->cnt)))
+        return NULL;
 
-    const char * _name;
-    const char * _pwrd;
-    const char * _device;
+    size_t off = frame - ring->block;
+    if ((off % ring->frame_size) != 0)
+        return NULL;
 
-    if (WC_CFG_VALUES != NULL) {
-        _name =  get_cfg_value(CFG_USER_NAME);
-        _pwrd =  get_cfg_value(CFG_USER_PASSWORD);
-        _device = get_cfg_value(CFG_DEVICE_NAME);
-    }
-    else {
-        _name =  HTTP2_SERVER_NAME;
-        _pwrd =  HTTP2_SERVER_PASS;
-        _device =  app.mac_str;
+    return &(ring->slots[off / ring->frame_size]);
+}
+
+/* the oldest slot in the given state. locked by caller */
+static h2pca_frame_slot * __stream_oldest(h2pca_frame_ring * ring, h2pca_frame_state state) {
+    h2pca_frame_slot * res = NULL;
+
+    for (int i = 0; i < ring->cnt; ++i) {
+        h2pca_frame_slot * slot = &(ring->slots[i]);
+        if ((slot->state == state) &&
+            ((res == NULL) || ((int32_t)(slot->seq - res->seq) < 0)))
+            res = slot;
     }
+    return res;
+}
 
-    int res = h2pc_req_authorize_sync(_name, _pwrd, _device, app.cfg->device_meta_data, false);
+/* upload ready frames. returns the count of upload attempts,
+ * the failed one included */
+static int __stream_frames(h2pca_status * ctx) {
+    h2pca_frame_ring * ring = ctx->frames;
+    int tried = 0;
 
-    if (res == ESP_OK) {
-        h2pca_locked_CLR_STATE(MODE_AUTH);
-        h2pca_locked_SET_STATE(AUTHORIZED_BIT | MODE_RECIEVE_MSG);
-        strcpy(app.device_name, _device);
-        ESP_LOGI(app.cfg->LOG_TAG, "hash=%s", h2pc_get_sid());
+    if ((ring == NULL) || (ctx->cfg->on_send_frame == NULL)) return 0;
+
+    for (int i = 0; i < ctx->cfg->stream_frames_per_step; ++i) {
+        portENTER_CRITICAL(&(ring->lock));
+        h2pca_frame_slot * slot = __stream_oldest(ring, FRAME_READY);
+        if (slot != NULL)
+            slot->state = FRAME_SENDING;
+        portEXIT_CRITICAL(&(ring->lock));
+
+        if (slot == NULL) break;
+
+        uint32_t seq = slot->seq;
+        tried++;
+        esp_err_t err = ctx->cfg->on_send_frame(slot->data, slot->len, seq);
+        int64_t now = esp_timer_get_time();
+
+        portENTER_CRITICAL(&(ring->lock));
+        if (err == ESP_OK) {
+            int64_t latency = now - slot->ts;
+            h2pca_stream_stats * stats = &(ctx->stream_stats);
+            stats->sent++;
+            stats->bytes_sent += slot->len;
+            ctx->last_alive = now;
+            stats->latency_sum += latency;
+            if (latency > stats->latency_max)
+                stats->latency_max = latency;
+
+            ring->window_frames++;
+            if (now - ring->window_start >= 1000000) {
+                stats->fps = (float) ring->window_frames * 1000000.0f / (float)(now - ring->window_start);
+                ring->window_start = now;
+                ring->window_frames = 0;
+            }
+            slot->state = FRAME_FREE;
+        } else {
+            ctx->stream_stats.send_errors++;
+            /* keep the frame to retry or to drop under backpressure */
+            slot->state = FRAME_READY;
+        }
+        portEXIT_CRITICAL(&(ring->lock));
+
+        if (err != ESP_OK) {
+            ESP_LOGW(ctx->cfg->LOG_TAG, "Frame %" PRIu32 " upload failed: %d", seq, err);
+            break;
+        }
+    }
+
+    return tried;
+}
+
+static uint8_t * h2pca_ctx_frame_acquire(h2pca_status * ctx, size_t * capacity) {
+    if ((ctx == NULL) || (ctx->frames == NULL)) return NULL;
+
+    h2pca_frame_ring * ring = ctx->frames;
+
+    portENTER_CRITICAL(&(ring->lock));
+    h2pca_frame_slot * slot = NULL;
+    for (int i = 0; i < ring->cnt; ++i) {
+        if (ring->slots[i].state == FRAME_FREE) {
+            slot = &(ring->slots[i]);
+            break;
+        }
+    }
+    if (slot == NULL) {
+        /* backpressure - drop the oldest frame waiting for upload */
+        slot = __stream_oldest(ring, FRAME_READY);
+        if (slot != NULL)
+            ctx->stream_stats.dropped++;
+    }
+    if (slot != NULL) {
+        slot->state = FRAME_FILLING;
+        slot->len = 0;
+    }
+    portEXIT_CRITICAL(&(ring->lock));
+
+    if (slot == NULL) return NULL;
+
+    if (capacity != NULL)
+        *capacity = ring->frame_size;
+
+    return slot->data;
+}
+
+static esp_err_t h2pca_ctx_frame_commit(h2pca_status * ctx, uint8_t * frame, size_t len) {
+    if ((ctx == NULL) || (ctx->frames == NULL)) return ESP_ERR_INVALID_STATE;
+
+    h2pca_frame_ring * ring = ctx->frames;
+    h2pca_frame_slot * slot = __stream_slot_of(ring, frame);
+    if ((slot == NULL) || (len > ring->frame_size)) return ESP_ERR_INVALID_ARG;
+
+    esp_err_t res = ESP_OK;
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&(ring->lock));
+    if (slot->state == FRAME_FILLING) {
+        slot->len = len;
+        slot->ts = now;
+        slot->seq = ring->seq++;
+        slot->state = FRAME_READY;
+        ctx->stream_stats.committed++;
+    } else
+        res = ESP_ERR_INVALID_ARG;
+    portEXIT_CRITICAL(&(ring->lock));
+
+    return res;
+}
+
+static esp_err_t h2pca_ctx_frame_release(h2pca_status * ctx, uint8_t * frame) {
+    if ((ctx == NULL) || (ctx->frames == NULL)) return ESP_ERR_INVALID_STATE;
+
+    h2pca_frame_ring * ring = ctx->frames;
+    h2pca_frame_slot * slot = __stream_slot_of(ring, frame);
+    if (slot == NULL) return ESP_ERR_INVALID_ARG;
+
+    esp_err_t res = ESP_OK;
+
+    portENTER_CRITICAL(&(ring->lock));
+    if (slot->state == FRAME_FILLING)
+        slot->state = FRAME_FREE;
+    else
+        res = ESP_ERR_INVALID_ARG;
+    portEXIT_CRITICAL(&(ring->lock));
+
+    return res;
+}
+
+static int32_t h2pca_ctx_frames_pending(h2pca_status * ctx) {
+    if ((ctx == NULL) || (ctx->frames == NULL)) return 0;
+
+    h2pca_frame_ring * ring = ctx->frames;
+    int32_t cnt = 0;
+
+    portENTER_CRITICAL(&(ring->lock));
+    for (int i = 0; i < ring->cnt; ++i) {
+        if (ring->slots[i].state == FRAME_READY)
+            cnt++;
+    }
+    portEXIT_CRITICAL(&(ring->lock));
+
+    return cnt;
+}
+
+static esp_err_t h2pca_ctx_get_stream_stats(h2pca_status * ctx, h2pca_stream_stats * stats) {
+    if ((ctx == NULL) || (stats == NULL)) return ESP_ERR_INVALID_ARG;
+
+    if (ctx->frames == NULL) {
+        memset(stats, 0, sizeof(h2pca_stream_stats));
+        return ESP_OK;
+    }
+
+    portENTER_CRITICAL(&(ctx->frames->lock));
+    *stats = ctx->stream_stats;
+    portEXIT_CRITICAL(&(ctx->frames->lock));
+
+    return ESP_OK;
+}
+#endif
+
+/* RTC retained state */
+
+/* virtual clock, continued between deep sleeps (in us) */
+static int64_t __rtc_now() {
+    return rtc_state.clock + esp_timer_get_time();
+}
+
+static void __rtc_save_om(h2pca_status * ctx) {
+    h2pca_om_item * item;
+    int dropped = 0;
+
+    rtc_state.om_cnt = 0;
+    rtc_state.om_len = 0;
+
+    while ((item = __om_pop(ctx)) != NULL) {
+        if ((rtc_state.om_len + sizeof(uint16_t) + item->size) <= H2PCA_RTC_OM_SIZE) {
+            memcpy(&(rtc_state.om[rtc_state.om_len]), &(item->size), sizeof(uint16_t));
+            rtc_state.om_len += sizeof(uint16_t);
+            memcpy(&(rtc_state.om[rtc_state.om_len]), item->data, item->size);
+            rtc_state.om_len += item->size;
+            rtc_state.om_cnt++;
+        } else
+            dropped++;
+        __mem_free(H2PCA_MEM_APP, item);
+    }
+
+    if (dropped > 0)
+        ESP_LOGW(ctx->cfg->LOG_TAG, "%d outgoing msgs dropped before sleep", dropped);
+}
+
+static void __rtc_restore_om(h2pca_status * ctx) {
+    uint32_t pos = 0;
+
+    for (int i = 0; i < rtc_state.om_cnt; ++i) {
+        uint16_t sz;
+        memcpy(&sz, &(rtc_state.om[pos]), sizeof(uint16_t));
+        pos += sizeof(uint16_t);
+
+        h2pca_om_item * item = (h2pca_om_item *)__mem_alloc(H2PCA_MEM_APP, sizeof(h2pca_om_item) + sz);
+        if (item == NULL) break;
+
+        item->next = NULL;
+        item->size = sz;
+        memcpy(item->data, &(rtc_state.om[pos]), sz);
+        pos += sz;
+
+        __om_push(ctx, item);
+    }
+
+    rtc_state.om_cnt = 0;
+    rtc_state.om_len = 0;
+}
+
+static void __rtc_restore(h2pca_status * ctx) {
+    if ((esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER) &&
+        (rtc_state.magic == RTC_STATE_MAGIC)) {
+        ctx->woken_from_sleep = true;
+        ctx->wakeups = ++rtc_state.wakeups;
+        ctx->awake_time = rtc_state.awake_time;
+
+        h2pca_ctx_locked_SET_STATE(ctx, rtc_state.states & ~MODE_VOLATILE);
+
+        __rtc_restore_om(ctx);
+    } else {
+        memset(&rtc_state, 0, sizeof(h2pca_rtc_state));
+        rtc_state.magic = RTC_STATE_MAGIC;
+    }
+}
+
+esp_err_t h2pca_init_cfg(h2pca_config * cfg) {
+    if (cfg == NULL) return ESP_ERR_INVALID_ARG;
+
+    memset(cfg, 0x00, sizeof(h2pca_config));
+
+    cfg->recv_msgs_period = GET_MSG_TIMER_DELTA;
+    cfg->send_msgs_period = SEND_MSG_TIMER_DELTA;
+    cfg->main_loop_period = MAIN_TASK_LOOP_DELAY;
+
+    cfg->inmsgs_proceed_chunk = STD_MSGS_CHUNK_SZ;
+
+    cfg->workers_cnt = WORKERS_CNT;
+    cfg->workers_priority = WORKERS_PRIORITY;
+    cfg->workers_stack_size = WORKERS_STACK_SIZE;
+    cfg->workers_queue_depth = WORKERS_QUEUE_DEPTH;
+    cfg->workers_overflow = H2PCA_OVERFLOW_COALESCE;
+
+#ifdef CONFIG_WC_USE_IO_STREAMS
+    cfg->stream_frame_size = STREAM_FRAME_SIZE;
+    cfg->stream_use_psram = true;
+    cfg->stream_frames_per_step = STREAM_FRAMES_PER_STEP;
+#endif
+
+    /* not limited. the bursts are used when a rate is set */
+    cfg->send_rate_msgs = 0;
+    cfg->send_burst_msgs = SEND_BURST_MSGS;
+    cfg->send_rate_bytes = 0;
+    cfg->send_burst_bytes = SEND_BURST_BYTES;
+
+    cfg->telemetry_period = 0;
+
+    cfg->keepalive_period = KEEPALIVE_PERIOD;
+    cfg->keepalive_max_fails = KEEPALIVE_MAX_FAILS;
+
+    cfg->error_default_tier = H2PCA_RECOVER_RECONNECT;
+    cfg->error_retry_backoff = ERROR_RETRY_BACKOFF;
+    cfg->error_retry_max = ERROR_RETRY_MAX;
+
+    cfg->duty_cycle_max_awake = DUTY_CYCLE_MAX_AWAKE;
+    cfg->duty_cycle_min_sleep = DUTY_CYCLE_MIN_SLEEP;
+
+    cfg->h2pcmode = H2PC_MODE_MESSAGING;
+
+    h2pca_ble_config_init_standard(&(cfg->ble_cfg));
+
+    return ESP_OK;
+}
+
+static esp_err_t h2pca_ctx_init(h2pca_status * ctx, h2pca_config * cfg) {
+    if ((ctx == NULL) || (cfg == NULL)) return ESP_ERR_INVALID_ARG;
+
+    memset(ctx, 0, sizeof(h2pca_status));
+
+#ifdef CONFIG_H2PCA_MEM_ACCOUNTING
+    cJSON_Hooks hooks = {
+        .malloc_fn = &__json_malloc,
+        .free_fn = &__json_free,
+    };
+    cJSON_InitHooks(&hooks);
+#endif
+
+    ctx->cfg = cfg;
+    ctx->client_state = xEventGroupCreate();
+    vPortCPUInitializeMutex(&(ctx->om_lock));
+    ctx->send_rate_scale = H2PCA_RATE_SCALE_FULL;
+    vPortCPUInitializeMutex(&(ctx->tasks_lock));
+    ctx->tasks_ctl = xSemaphoreCreateMutex();
+    if (ctx->tasks_ctl == NULL)
+        return ESP_ERR_NO_MEM;
+
+    __rtc_restore(ctx);
+
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        err = nvs_flash_erase();
+        if (err != ESP_OK) {
+            h2pca_ctx_done(ctx);
+            return err;
+        }
+        err = nvs_flash_init();
+    }
+    if (err != ESP_OK) {
+        h2pca_ctx_done(ctx);
+        return err;
+    }
+
+    /* generate mac address and device metadata */
+    uint8_t sta_mac[6];
+    err = esp_efuse_mac_get_default(sta_mac);
+    if (err != ESP_OK) {
+        h2pca_ctx_done(ctx);
+        return err;
+    }
+
+    for (int i = 0; i < 6; i++) {
+        ctx->mac_str[i<<1] = UPPER_XDIGITS[(sta_mac[i] >> 4) & 0x0f];
+        ctx->mac_str[(i<<1) + 1] = UPPER_XDIGITS[(sta_mac[i] & 0x0f)];
+    }
+
+    ctx->mac_str[12] = 0;
+
+    memset(ctx->device_char, '0', 4);
+
+    ctx->device_char[4] = UPPER_XDIGITS[(uint8_t)((CONFIG_WC_DEVICE_CHAR1_UUID >> 12) & 0x000f)];
+    ctx->device_char[5] = UPPER_XDIGITS[(uint8_t)((CONFIG_WC_DEVICE_CHAR1_UUID >> 8) & 0x000f)];
+    ctx->device_char[6] = UPPER_XDIGITS[(uint8_t)((CONFIG_WC_DEVICE_CHAR1_UUID >> 4) & 0x000f)];
+    ctx->device_char[7] = UPPER_XDIGITS[(uint8_t)((CONFIG_WC_DEVICE_CHAR1_UUID) & 0x000f)];
+
+    if (ctx->cfg->device_meta_data == NULL)
+        ctx->cfg->device_meta_data = cJSON_CreateObject();
+    cJSON_AddItemToObject(ctx->cfg->device_meta_data, JSON_BLE_CHAR, cJSON_CreateStringReference(ctx->device_char));
+
+#ifdef CONFIG_WC_USE_IO_STREAMS
+    err = __stream_init(ctx);
+    if (err != ESP_OK) {
+        h2pca_ctx_done(ctx);
+        return err;
+    }
+#endif
+
+    return ESP_OK;
+}
+
+esp_err_t h2pca_ble_config_init(h2pca_ble_config * cfg, int count, const char ** cfg_field, uint8_t * cfg_id) {
+    if (cfg == NULL) return ESP_ERR_INVALID_ARG;
+
+
+    cfg->count = count;
+    cfg->ids = cfg_field;
+    cfg->cfgs = cfg_id;
+
+    return ESP_OK;
+}
+
+esp_err_t h2pca_ble_config_init_standard(h2pca_ble_config * cfg) {
+    if (cfg == NULL) return ESP_ERR_INVALID_ARG;
+
+    cfg->count = get_ble_std_config_count();
+    cfg->ids = get_ble_std_config_idstr();
+    cfg->cfgs = get_ble_std_config_idkey();
+
+    return ESP_OK;
+}
+
+
+static void set_time(void)
+{
+    struct timeval tv = {
+        .tv_sec = 1509449941,
+    };
+    struct timezone tz;
+    memset(&tz, 0, sizeof(tz));
+    settimeofday(&tv, &tz);
+
+    /* Start SNTP service */
+    sntp_setoperatingmode(SNTP_OPMODE_POLL);
+    sntp_init();
+}
+
+/* disconnect from host. reset all states */
+static void __disconnect_host(h2pca_status * ctx) {
+    if (h2pca_ctx_locked_CHK_STATE(ctx, HOST_CONNECTED_BIT))
+        h2pc_disconnect_http2();
+    else
+        h2pc_reset_buffers();
+    __om_h2pc_done(ctx);
+    h2pca_ctx_locked_CLR_ALL_STATES(ctx);
+    ctx->retry_mode = 0;
+    memset(ctx->retries, 0, sizeof(ctx->retries));
+
+    EXEC_CB(on_disconnect);
+}
+
+static h2pca_recovery __classify_error(h2pca_status * ctx, int err) {
+    const h2pca_error_rule * rules = ctx->cfg->error_rules;
+    int32_t cnt = ctx->cfg->error_rules_cnt;
+
+    if (rules == NULL) {
+        rules = STD_ERROR_RULES;
+        cnt = sizeof(STD_ERROR_RULES) / sizeof(h2pca_error_rule);
+    }
+
+    for (int i = 0; i < cnt; ++i) {
+        if (rules[i].error == err)
+            return rules[i].tier;
+    }
+    return ctx->cfg->error_default_tier;
+}
+
+/* index of the retry state of the step (-1 if the step is not retried) */
+static int __retry_slot(h2pca_state step) {
+    switch (step) {
+    case MODE_AUTH:        return 0;
+    case MODE_RECIEVE_MSG: return 1;
+    case MODE_SEND_MSG:    return 2;
+    default:               return -1;
+    }
+}
+
+/* is the step (MODE_* bit) requested and not waiting for retry */
+static bool __step_ready(h2pca_status * ctx, h2pca_state step) {
+    if (!h2pca_ctx_locked_CHK_STATE(ctx, step))
+        return false;
+
+    return ((ctx->retry_mode & step) == 0) ||
+           (esp_timer_get_time() >= ctx->retry_at[__retry_slot(step)]);
+}
+
+/* check errors after the step. step - MODE_* bit of the step to retry
+ * or 0 if the step can not be retried. errs_before - count of protocol
+ * errors before the step: the request steps reset the count and pass 0,
+ * the other steps pass the snapshot, so the error of the previous
+ * request is not classified again */
+static void __check_h2pc_errors(h2pca_status * ctx, h2pca_state step, int errs_before) {
+    int slot = __retry_slot(step);
+
+    if (h2pca_ctx_locked_CHK_STATE(ctx, WIFI_CONNECTED_BIT|HOST_CONNECTED_BIT)) {
+        if (h2pc_get_connected()) {
+            if (h2pc_get_protocol_errors_cnt() > errs_before) {
+                int err = h2pc_get_last_error();
+
+                if (err != REST_RESULT_OK)
+                    EXEC_CB(on_error, err);
+
+                h2pca_recovery tier = __classify_error(ctx, err);
+
+                if (tier == H2PCA_RECOVER_RETRY) {
+                    if (slot < 0)
+                        tier = H2PCA_RECOVER_IGNORE;
+                    else
+                    if (ctx->retries[slot] >= ctx->cfg->error_retry_max)
+                        tier = H2PCA_RECOVER_RECONNECT;
+                }
+
+                ctx->recoveries[tier]++;
+                TRACE(H2PCA_TRACE_RECOVERY, tier, err);
+
+                switch (tier) {
+                case H2PCA_RECOVER_IGNORE:
+                    break;
+                case H2PCA_RECOVER_RETRY: {
+                    uint8_t shift = (ctx->retries[slot] < ERROR_RETRY_MAX_SHIFT) ? ctx->retries[slot] : ERROR_RETRY_MAX_SHIFT;
+                    ctx->retries[slot]++;
+                    ctx->retry_mode |= step;
+                    ctx->retry_at[slot] = esp_timer_get_time() + ((int64_t) ctx->cfg->error_retry_backoff << shift);
+                    /* the step keeps its state bit and is repeated after backoff */
+                    h2pca_ctx_locked_SET_STATE(ctx, step);
+                    ESP_LOGW(ctx->cfg->LOG_TAG, "Error %d, retry %d", err, ctx->retries[slot]);
+                    break;
+                }
+                case H2PCA_RECOVER_REAUTH:
+                    h2pca_ctx_locked_CLR_STATE(ctx, AUTHORIZED_BIT);
+                    h2pca_ctx_locked_SET_STATE(ctx, MODE_AUTH);
+                    break;
+                case H2PCA_RECOVER_REBOOT:
+                    ESP_LOGE(ctx->cfg->LOG_TAG, "Error %d, restart", err);
+                    __disconnect_host(ctx);
+                    esp_restart();
+                    break;
+                default:
+                    __disconnect_host(ctx);
+                    break;
+                }
+
+                if ((tier != H2PCA_RECOVER_RETRY) && (slot >= 0)) {
+                    ctx->retries[slot] = 0;
+                    ctx->retry_mode &= ~step;
+                }
+            } else
+            if (slot >= 0) {
+                ctx->retries[slot] = 0;
+                ctx->retry_mode &= ~step;
+            }
+        } else {
+            ctx->recoveries[H2PCA_RECOVER_RECONNECT]++;
+            __disconnect_host(ctx);
+        }
+    }
+}
+
+/* connect to host */
+static void __connect_to_http2(h2pca_status * ctx) {
+    __disconnect_host(ctx);
+
+    char * addr;
+    if (WC_CFG_VALUES != NULL)
+        addr = get_cfg_value(CFG_HOST_NAME);
+    else
+        addr = HTTP2_SERVER_URI;
+
+    TRACE(H2PCA_TRACE_REQ_BEGIN, H2PCA_TRACE_REQ_CONNECT, 0);
+    bool connected = h2pc_connect_to_http2(addr);
+    TRACE(H2PCA_TRACE_REQ_END, H2PCA_TRACE_REQ_CONNECT, connected);
+
+    if (connected) {
+        ctx->connect_errors = 0;
+        __send_bucket_reset(ctx);
+        if (h2pca_ctx_om_count(ctx) > 0) {
+            ctx->drain_start = esp_timer_get_time();
+            ctx->drain_msgs = h2pca_ctx_om_count(ctx);
+            ctx->drain_batches_at = ctx->batches;
+        }
+        ctx->last_alive = esp_timer_get_time();
+        ctx->keepalive_fails = 0;
+
+        h2pca_ctx_locked_SET_STATE(ctx, HOST_CONNECTED_BIT | MODE_AUTH);
+
+        EXEC_CB(on_connect);
+    } else {
+        ctx->connect_errors++;
+        ctx->connect_fails++;
+    }
+}
+
+static void __send_authorize(h2pca_status * ctx) {
+    ESP_LOGI(ctx->cfg->LOG_TAG, "Trying to authorize");
+
+    const char * _name;
+    const char * _pwrd;
+    const char * _device;
+
+    if (WC_CFG_VALUES != NULL) {
+        _name =  get_cfg_value(CFG_USER_NAME);
+        _pwrd =  get_cfg_value(CFG_USER_PASSWORD);
+        _device = get_cfg_value(CFG_DEVICE_NAME);
+    }
+    else {
+        _name =  HTTP2_SERVER_NAME;
+        _pwrd =  HTTP2_SERVER_PASS;
+        _device =  ctx->mac_str;
+    }
+
+    TRACE(H2PCA_TRACE_REQ_BEGIN, H2PCA_TRACE_REQ_AUTHORIZE, 0);
+    int res = h2pc_req_authorize_sync(_name, _pwrd, _device, ctx->cfg->device_meta_data, false);
+    TRACE(H2PCA_TRACE_REQ_END, H2PCA_TRACE_REQ_AUTHORIZE, res);
+
+    if (res == ESP_OK) {
+        ctx->last_alive = esp_timer_get_time();
+        h2pca_ctx_locked_CLR_STATE(ctx, MODE_AUTH);
+#ifdef CONFIG_H2PCA_NO_INMSGS
+        h2pca_ctx_locked_SET_STATE(ctx, AUTHORIZED_BIT);
+#else
+        h2pca_ctx_locked_SET_STATE(ctx, AUTHORIZED_BIT | MODE_RECIEVE_MSG);
+#endif
+        strcpy(ctx->device_name, _device);
+        strncpy(ctx->session, h2pc_get_sid(), H2PCA_SID_SIZE - 1);
+        ESP_LOGI(ctx->cfg->LOG_TAG, "hash=%s", h2pc_get_sid());
 
         EXEC_CB(on_auth, h2pc_get_sid());
     }
     else
-    if (res == H2PC_ERR_PROTOCOL)
-        __check_h2pc_errors();
+    /* protocol errors are classified by the caller after the step */
+    if (res != H2PC_ERR_PROTOCOL)
+        __disconnect_host(ctx);
+}
+
+
+/* Wi-Fi fast reconnect */
+
+static uint32_t __wifi_cache_checksum() {
+    return __fnv1a(FNV_OFFSET_BASIS, &wifi_cache, offsetof(h2pca_wifi_cache, checksum));
+}
+
+static bool __wifi_cache_valid(uint32_t cfg_hash) {
+    return (wifi_cache.magic == WIFI_CACHE_MAGIC) &&
+           (wifi_cache.cfg_hash == cfg_hash) &&
+           (wifi_cache.checksum == __wifi_cache_checksum());
+}
+
+static void __wifi_cache_invalidate() {
+    wifi_cache.magic = 0;
+}
+
+/* the lease time of the current DHCP address (in s, 0 - no lease) */
+static uint32_t __wifi_lease_time() {
+    struct netif * netif = NULL;
+
+    if ((tcpip_adapter_get_netif(TCPIP_ADAPTER_IF_STA, (void **) &netif) != ESP_OK) || (netif == NULL))
+        return 0;
+
+    struct dhcp * dhcp = netif_dhcp_data(netif);
+    return (dhcp != NULL) ? dhcp->offered_t0_lease : 0;
+}
+
+static bool __wifi_lease_valid() {
+    return (wifi_cache.lease_expire > 0) &&
+           ((int64_t) esp_clk_rtc_time() + WIFI_LEASE_MARGIN < wifi_cache.lease_expire);
+}
+
+static void __wifi_cache_save(h2pca_status * ctx, const tcpip_adapter_ip_info_t * ip_info) {
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) return;
+
+    uint32_t lease_time = __wifi_lease_time();
+    if (lease_time > 0) {
+        /* the RTC clock runs through deep sleeps and software resets */
+        wifi_cache.lease_time = lease_time;
+        wifi_cache.lease_expire = (int64_t) esp_clk_rtc_time() + (int64_t) lease_time * 1000000;
+    } else
+    if (!__wifi_cache_valid(ctx->wifi_cfg_hash) || (wifi_cache.ip_info.ip.addr != ip_info->ip.addr)) {
+        /* the address is not from DHCP and not the cached one */
+        wifi_cache.lease_time = 0;
+        wifi_cache.lease_expire = 0;
+    }
+    /* otherwise the cached address is reused and keeps its expiry */
+
+    memcpy(wifi_cache.bssid, ap_info.bssid, sizeof(wifi_cache.bssid));
+    wifi_cache.channel = ap_info.primary;
+    wifi_cache.ip_info = *ip_info;
+    if (tcpip_adapter_get_dns_info(TCPIP_ADAPTER_IF_STA, TCPIP_ADAPTER_DNS_MAIN, &(wifi_cache.dns_info)) != ESP_OK)
+        memset(&(wifi_cache.dns_info), 0, sizeof(tcpip_adapter_dns_info_t));
+    wifi_cache.cfg_hash = ctx->wifi_cfg_hash;
+    wifi_cache.magic = WIFI_CACHE_MAGIC;
+    wifi_cache.checksum = __wifi_cache_checksum();
+}
+
+/* apply the cached connection params to the config */
+static void __wifi_apply_cache(h2pca_status * ctx, wifi_config_t * wifi_config) {
+    wifi_config->sta.bssid_set = true;
+    memcpy(wifi_config->sta.bssid, wifi_cache.bssid, sizeof(wifi_cache.bssid));
+    wifi_config->sta.channel = wifi_cache.channel;
+
+    /* the expired lease could be given to another host */
+    if (ctx->cfg->wifi_static_ip && __wifi_lease_valid()) {
+        esp_err_t err = tcpip_adapter_dhcpc_stop(TCPIP_ADAPTER_IF_STA);
+        if (err == ESP_ERR_TCPIP_ADAPTER_DHCP_ALREADY_STOPPED)
+            err = ESP_OK;
+        if (err == ESP_OK)
+            err = tcpip_adapter_set_ip_info(TCPIP_ADAPTER_IF_STA, &(wifi_cache.ip_info));
+        if (err == ESP_OK)
+            err = tcpip_adapter_set_dns_info(TCPIP_ADAPTER_IF_STA, TCPIP_ADAPTER_DNS_MAIN, &(wifi_cache.dns_info));
+
+        if (err != ESP_OK) {
+            ESP_LOGW(ctx->cfg->LOG_TAG, "Cached IP is not applied (%d). Use DHCP", err);
+            tcpip_adapter_dhcpc_start(TCPIP_ADAPTER_IF_STA);
+        }
+    }
+
+    ctx->wifi_fast_attempt = true;
+}
+
+/* directed connect failed. drop the cache and fall back to the full scan */
+static void __wifi_fallback(h2pca_status * ctx) {
+    wifi_config_t wifi_config;
+
+    ESP_LOGI(ctx->cfg->LOG_TAG, "Fast connect failed. Fall back to full scan");
+
+    __wifi_cache_invalidate();
+    ctx->wifi_fast_attempt = false;
+
+    if (ctx->cfg->wifi_static_ip)
+        tcpip_adapter_dhcpc_start(TCPIP_ADAPTER_IF_STA);
+
+    if (esp_wifi_get_config(ESP_IF_WIFI_STA, &wifi_config) == ESP_OK) {
+        wifi_config.sta.bssid_set = false;
+        wifi_config.sta.channel = 0;
+        esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
+    }
+}
+
+static esp_err_t __wifi_connect(h2pca_status * ctx) {
+    ctx->wifi_connect_start = esp_timer_get_time();
+    return esp_wifi_connect();
+}
+
+static esp_err_t event_handler(void *arg, system_event_t *event)
+{
+    h2pca_status * ctx = (h2pca_status *)arg;
+
+    switch (event->event_id) {
+    case SYSTEM_EVENT_STA_START:
+        ESP_LOGI(ctx->cfg->LOG_TAG, "SYSTEM_EVENT_STA_START");
+        ESP_ERROR_CHECK(__wifi_connect(ctx));
+        EXEC_CB(on_wifi_init);
+        break;
+    case SYSTEM_EVENT_STA_GOT_IP:
+        ESP_LOGI(ctx->cfg->LOG_TAG, "SYSTEM_EVENT_STA_GOT_IP");
+        ESP_LOGI(ctx->cfg->LOG_TAG, "got ip:%s", ip4addr_ntoa(&event->event_info.got_ip.ip_info.ip));
+        h2pca_ctx_locked_SET_STATE(ctx, WIFI_CONNECTED_BIT);
+        h2pca_ctx_locked_SET_STATE(ctx, MODE_SETIME);
+        ctx->wifi_connect_errors = 0;
+
+        ctx->wifi_time_to_ip = esp_timer_get_time() - ctx->wifi_connect_start;
+        ESP_LOGI(ctx->cfg->LOG_TAG, "time to ip:%" PRId64 " us (%s)", ctx->wifi_time_to_ip,
+                                   ctx->wifi_fast_attempt ? "fast" : "scan");
+        if (ctx->cfg->wifi_fast_connect)
+            __wifi_cache_save(ctx, &(event->event_info.got_ip.ip_info));
+
+        EXEC_CB(on_wifi_con);
+        break;
+    case SYSTEM_EVENT_STA_DISCONNECTED:
+        ESP_LOGI(ctx->cfg->LOG_TAG, "SYSTEM_EVENT_STA_DISCONNECTED");
+
+        if (ctx->wifi_fast_attempt && !h2pca_ctx_locked_CHK_STATE(ctx, WIFI_CONNECTED_BIT)) {
+            /* retry at once with the full scan */
+            __wifi_fallback(ctx);
+            __wifi_connect(ctx);
+        } else {
+            ctx->wifi_connect_errors++;
+            ctx->wifi_fails++;
+        }
+
+        sntp_stop();
+
+        if (h2pca_ctx_locked_CHK_STATE(ctx, HOST_CONNECTED_BIT)) h2pc_disconnect_http2();
+        h2pca_ctx_locked_CLR_ALL_STATES(ctx);
+
+        h2pca_ctx_locked_CLR_STATE(ctx, WIFI_CONNECTED_BIT);
+        h2pc_reset_buffers();
+
+        EXEC_CB(on_wifi_dis);
+
+        break;
+    default:
+        break;
+    }
+    return ESP_OK;
+}
+
+static void initialise_wifi(h2pca_status * ctx)
+{
+    tcpip_adapter_init();
+    ESP_ERROR_CHECK( esp_event_loop_init(event_handler, ctx) );
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK( esp_wifi_init(&cfg) );
+    ESP_ERROR_CHECK( esp_wifi_set_storage(WIFI_STORAGE_RAM) );
+    wifi_config_t wifi_config;
+    memset(&wifi_config, 0x00, sizeof(wifi_config_t));
+
+    char * value = get_cfg_value(CFG_SSID_NAME);
+    if (value != NULL) {
+        strcpy((char *) &(wifi_config.sta.ssid[0]), value);
+        ESP_LOGD(ctx->cfg->LOG_TAG, "SSID setted from json config");
+    } else {
+        strcpy((char *) &(wifi_config.sta.ssid[0]), APP_WIFI_SSID);
+        ESP_LOGD(ctx->cfg->LOG_TAG, "SSID setted from flash config");
+    }
+    value = get_cfg_value(CFG_SSID_PASSWORD);
+    if (value != NULL) {
+        strcpy((char *) &(wifi_config.sta.password[0]), value);
+        ESP_LOGD(ctx->cfg->LOG_TAG, "Password setted from json config");
+    } else {
+        strcpy((char *) &(wifi_config.sta.password[0]), APP_WIFI_PASS);
+        ESP_LOGD(ctx->cfg->LOG_TAG, "Password setted from flash config");
+    }
+
+    ctx->wifi_cfg_hash = __fnv1a(FNV_OFFSET_BASIS, wifi_config.sta.ssid, sizeof(wifi_config.sta.ssid));
+    ctx->wifi_cfg_hash = __fnv1a(ctx->wifi_cfg_hash, wifi_config.sta.password, sizeof(wifi_config.sta.password));
+
+    if (ctx->cfg->wifi_fast_connect) {
+        if (__wifi_cache_valid(ctx->wifi_cfg_hash)) {
+            __wifi_apply_cache(ctx, &wifi_config);
+            ESP_LOGD(ctx->cfg->LOG_TAG, "Fast connect to the cached AP on channel %d", wifi_config.sta.channel);
+        } else
+            __wifi_cache_invalidate();
+    }
+
+    ESP_LOGI(ctx->cfg->LOG_TAG, "Setting WiFi configuration SSID %s...", wifi_config.sta.ssid);
+    ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA) );
+    ESP_ERROR_CHECK( esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) );
+    ESP_ERROR_CHECK( esp_wifi_start() );
+}
+
+
+void __msgs_get_cb(void* arg)
+{
+    h2pca_status * ctx = (h2pca_status *)arg;
+
+    ESP_LOGD(ctx->cfg->LOG_TAG, "Recieve msgs fired");
+    TRACE(H2PCA_TRACE_SYS_TIMER, H2PCA_TRACE_SYS_RECV, 0);
+    bool isempty = h2pc_im_locked_waiting();
+    if (isempty) {
+        if (h2pca_ctx_locked_CHK_STATE(ctx, HOST_CONNECTED_BIT))
+            h2pca_ctx_locked_SET_STATE(ctx, MODE_RECIEVE_MSG);
+    }
+}
+
+void __msgs_send_cb(void* arg)
+{
+    h2pca_status * ctx = (h2pca_status *)arg;
+
+    ESP_LOGD(ctx->cfg->LOG_TAG, "Send msgs fired");
+    TRACE(H2PCA_TRACE_SYS_TIMER, H2PCA_TRACE_SYS_SEND, 0);
+
+    bool isnempty = h2pc_om_locked_waiting() || (h2pca_ctx_om_count(ctx) > 0);
+    if (isnempty) {
+        if (h2pca_ctx_locked_CHK_STATE(ctx, HOST_CONNECTED_BIT))
+            h2pca_ctx_locked_SET_STATE(ctx, MODE_SEND_MSG);
+    }
+}
+
+void __telemetry_cb(void* arg)
+{
+    h2pca_status * ctx = (h2pca_status *)arg;
+
+    TRACE(H2PCA_TRACE_SYS_TIMER, H2PCA_TRACE_SYS_TELEMETRY, 0);
+    /* the previous report is still waiting */
+    if (ctx->telemetry_due)
+        ctx->telemetry_skipped++;
+    ctx->telemetry_due = true;
+}
+
+/* work queue */
+
+typedef struct h2pca_work_item_t
+{
+    h2pca_task * tsk;
+    int64_t queued_at;
+} h2pca_work_item;
+
+static void __work_enqueue(h2pca_status * ctx, h2pca_task * tsk, int64_t now) {
+    h2pca_work_item item = { .tsk = tsk, .queued_at = now };
+    TickType_t timeout = 0;
+
+    switch (ctx->cfg->workers_overflow) {
+    case H2PCA_OVERFLOW_COALESCE: {
+        bool queued;
+        portENTER_CRITICAL(&(ctx->tasks_lock));
+        queued = (tsk->flags & H2PCA_TASK_QUEUED) != 0;
+        if (queued)
+            ctx->work_stats.coalesced++;
+        else
+            tsk->flags |= H2PCA_TASK_QUEUED;
+        portEXIT_CRITICAL(&(ctx->tasks_lock));
+        if (queued) return;
+        break;
+    }
+    case H2PCA_OVERFLOW_BLOCK:
+        timeout = portMAX_DELAY;
+        break;
+    default:
+        break;
+    }
+
+    bool ok = (xQueueSend(ctx->work_queue, &item, timeout) == pdTRUE);
+
+    portENTER_CRITICAL(&(ctx->tasks_lock));
+    if (ok)
+        ctx->work_stats.queued++;
+    else {
+        ctx->work_stats.dropped++;
+        tsk->flags &= ~H2PCA_TASK_QUEUED;
+    }
+    portEXIT_CRITICAL(&(ctx->tasks_lock));
+}
+
+/* stamp the time the sync event of the task became pending. the apply
+ * bits are set by __user_task_cb or by on_time just before the call */
+static void __sync_stamp(h2pca_status * ctx, h2pca_task * tsk, int64_t now) {
+    if ((tsk->on_sync == NULL) || (tsk->apply_bitmask == 0)) return;
+
+    portENTER_CRITICAL(&(ctx->tasks_lock));
+    if (tsk->sync_ready_at == 0)
+        tsk->sync_ready_at = now;
+    portEXIT_CRITICAL(&(ctx->tasks_lock));
+}
+
+/* stamp the sync event if on_time has set the apply bits */
+static void __sync_stamp_applied(h2pca_status * ctx, h2pca_task * tsk) {
+    if ((tsk->on_sync != NULL) && (tsk->apply_bitmask != 0) &&
+        h2pca_ctx_locked_CHK_STATE(ctx, tsk->apply_bitmask | tsk->req_bitmask))
+        __sync_stamp(ctx, tsk, esp_timer_get_time());
+}
+
+static void __worker_task(void *args)
+{
+    h2pca_status * ctx = (h2pca_status *)args;
+    h2pca_work_item item;
+
+    while (1) {
+        if (xQueueReceive(ctx->work_queue, &item, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        h2pca_task * tsk = item.tsk;
+        int64_t latency = esp_timer_get_time() - item.queued_at;
+
+        portENTER_CRITICAL(&(ctx->tasks_lock));
+        tsk->flags &= ~H2PCA_TASK_QUEUED;
+        ctx->work_stats.executed++;
+        ctx->work_stats.latency_sum += latency;
+        if (latency > ctx->work_stats.latency_max)
+            ctx->work_stats.latency_max = latency;
+        portEXIT_CRITICAL(&(ctx->tasks_lock));
+
+        tsk->on_time(tsk->ID, tsk->user_data);
+        __sync_stamp_applied(ctx, tsk);
+    }
+}
+
+static void __start_workers(h2pca_status * ctx) {
+    bool need_workers = false;
+
+    for (int i = 0; i < ctx->cfg->tasks.cnt; ++i) {
+        if (POOL_TASK(&(ctx->cfg->tasks), i)->exec == H2PCA_EXEC_WORKER)
+            need_workers = true;
+    }
+    if (!need_workers || (ctx->cfg->workers_cnt == 0)) return;
+
+    ctx->work_queue = xQueueCreate(ctx->cfg->workers_queue_depth, sizeof(h2pca_work_item));
+    ctx->workers = (TaskHandle_t *) __mem_calloc(H2PCA_MEM_APP, ctx->cfg->workers_cnt, sizeof(TaskHandle_t));
+
+    if ((ctx->work_queue == NULL) || (ctx->workers == NULL))
+        ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+
+    for (int i = 0; i < ctx->cfg->workers_cnt; ++i) {
+        if (xTaskCreate(&__worker_task, WORKER_TASK_NAME, ctx->cfg->workers_stack_size, ctx,
+                        ctx->cfg->workers_priority, &(ctx->workers[i])) != pdPASS)
+            ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+
+        h2pca_register_task_stack(WORKER_TASK_NAME, ctx->workers[i], ctx->cfg->workers_stack_size);
+    }
+}
+
+static void __stop_workers(h2pca_status * ctx) {
+    if (ctx->workers != NULL) {
+        for (int i = 0; i < ctx->cfg->workers_cnt; ++i) {
+            if (ctx->workers[i] != NULL) {
+                h2pca_unregister_task_stack(ctx->workers[i]);
+                vTaskDelete(ctx->workers[i]);
+            }
+        }
+        __mem_free(H2PCA_MEM_APP, ctx->workers);
+        ctx->workers = NULL;
+    }
+    if (ctx->work_queue != NULL) {
+        vQueueDelete(ctx->work_queue);
+        ctx->work_queue = NULL;
+    }
+}
+
+static esp_err_t h2pca_ctx_get_work_stats(h2pca_status * ctx, h2pca_work_stats * stats) {
+    if ((ctx == NULL) || (stats == NULL)) return ESP_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&(ctx->tasks_lock));
+    *stats = ctx->work_stats;
+    portEXIT_CRITICAL(&(ctx->tasks_lock));
+
+    return ESP_OK;
+}
+
+static uint32_t __sync_deadline_misses(h2pca_status * ctx) {
+    uint32_t misses = 0;
+
+    for (int i = 0; i < ctx->cfg->tasks.cnt; ++i)
+        misses += POOL_TASK(&(ctx->cfg->tasks), i)->deadline_misses;
+    return misses;
+}
+
+static esp_err_t h2pca_ctx_get_sync_stats(h2pca_status * ctx, h2pca_sync_stats * stats) {
+    if ((ctx == NULL) || (stats == NULL) || (ctx->cfg == NULL)) return ESP_ERR_INVALID_ARG;
+
+    stats->deadline_misses = __sync_deadline_misses(ctx);
+    stats->aged = ctx->sync_aged;
+    stats->carry_caps = ctx->sync_carry_caps;
+
+    return ESP_OK;
+}
+
+void __user_task_cb(void* arg)
+{
+    h2pca_task * tsk = (h2pca_task *)arg;
+    h2pca_status * ctx = tsk->owner;
+    ESP_LOGD(tsk->TAG, "User task fired");
+    TRACE(H2PCA_TRACE_USER_TIMER, tsk->ID, 0);
+
+    int64_t now = esp_timer_get_time();
+
+    if (ctx->user_handles != NULL) {
+        portENTER_CRITICAL(&(ctx->tasks_lock));
+        /* the task could be re-armed or paused after the timer fired.
+         * its new state is kept then */
+        if (((tsk->flags & H2PCA_TASK_PAUSED) == 0) && (now >= tsk->deadline)) {
+            int64_t lateness = now - tsk->deadline;
+
+            if (tsk->flags & H2PCA_TASK_ONCE)
+                tsk->flags &= ~(H2PCA_TASK_ARMED | H2PCA_TASK_ONCE);
+            else
+                tsk->deadline += tsk->period;
+            ctx->work_stats.lateness_cnt++;
+            ctx->work_stats.lateness_sum += lateness;
+            if (lateness > ctx->work_stats.lateness_max)
+                ctx->work_stats.lateness_max = lateness;
+        }
+        portEXIT_CRITICAL(&(ctx->tasks_lock));
+    }
+
+    if (h2pca_ctx_locked_CHK_STATE(ctx, tsk->req_bitmask)) {
+
+        if (tsk->on_time) {
+            if ((tsk->exec == H2PCA_EXEC_WORKER) && (ctx->work_queue != NULL))
+                __work_enqueue(ctx, tsk, now);
+            else {
+                tsk->on_time(tsk->ID, tsk->user_data);
+                __sync_stamp_applied(ctx, tsk);
+            }
+        } else {
+            __sync_stamp(ctx, tsk, now);
+            h2pca_ctx_locked_SET_STATE(ctx, tsk->apply_bitmask);
+        }
+
+    }
+}
+
+/* user tasks control. the control calls are serialized by tasks_ctl,
+ * tasks_lock guards the state shared with the timer callbacks */
+
+static void __task_ctl_lock(h2pca_status * ctx) {
+    xSemaphoreTake(ctx->tasks_ctl, portMAX_DELAY);
+}
+
+static void __task_ctl_unlock(h2pca_status * ctx) {
+    xSemaphoreGive(ctx->tasks_ctl);
+}
+
+/* (re)start the timer of the task. locked by caller */
+static esp_err_t __task_arm(h2pca_status * ctx, int32_t idx, uint64_t timeout, bool once) {
+    h2pca_task * tsk = POOL_TASK(&(ctx->cfg->tasks), idx);
+    esp_timer_handle_t h = ctx->user_handles[idx];
+
+    /* not running timer returns an error here */
+    esp_timer_stop(h);
+
+    portENTER_CRITICAL(&(ctx->tasks_lock));
+    tsk->flags = (tsk->flags & ~(H2PCA_TASK_PAUSED | H2PCA_TASK_ONCE)) |
+                 H2PCA_TASK_ARMED | (once ? H2PCA_TASK_ONCE : 0);
+    tsk->deadline = esp_timer_get_time() + timeout;
+    portEXIT_CRITICAL(&(ctx->tasks_lock));
+
+    esp_err_t err;
+    if (once)
+        err = esp_timer_start_once(h, timeout);
+    else
+        err = esp_timer_start_periodic(h, timeout);
+
+    if (err != ESP_OK) {
+        portENTER_CRITICAL(&(ctx->tasks_lock));
+        tsk->flags &= ~(H2PCA_TASK_ARMED | H2PCA_TASK_ONCE);
+        portEXIT_CRITICAL(&(ctx->tasks_lock));
+    }
+    return err;
+}
+
+static esp_err_t __task_set_period(h2pca_status * ctx, int32_t idx, uint32_t period) {
+    h2pca_task * tsk = POOL_TASK(&(ctx->cfg->tasks), idx);
+    esp_err_t err = ESP_OK;
+
+    __task_ctl_lock(ctx);
+
+    portENTER_CRITICAL(&(ctx->tasks_lock));
+    tsk->period = period;
+    portEXIT_CRITICAL(&(ctx->tasks_lock));
+
+    if (ctx->user_handles != NULL) {
+        if ((tsk->flags & (H2PCA_TASK_ARMED | H2PCA_TASK_PAUSED | H2PCA_TASK_ONCE)) == H2PCA_TASK_ARMED)
+            err = __task_arm(ctx, idx, period, false);
+    } else
+    if (ctx->cfg->duty_cycle && (idx < rtc_state.tasks_cnt))
+        rtc_state.deadlines[idx] = __rtc_now() + period;
+
+    __task_ctl_unlock(ctx);
+
+    return err;
+}
+
+/* find the task with running timer */
+static esp_err_t __task_ctl_index(h2pca_status * ctx, h2pca_task_id ID, int32_t * idx) {
+    if (ctx == NULL) return ESP_ERR_INVALID_ARG;
+    if (ctx->cfg == NULL) return ESP_ERR_INVALID_STATE;
+
+    *idx = h2pca_task_pool_index_of(&(ctx->cfg->tasks), ID);
+    if (*idx < 0) return ESP_ERR_NOT_FOUND;
+    if (ctx->user_handles == NULL) return ESP_ERR_INVALID_STATE;
+
+    return ESP_OK;
+}
+
+static esp_err_t h2pca_ctx_task_schedule_once(h2pca_status * ctx, h2pca_task_id ID, uint64_t delay) {
+    int32_t idx;
+    esp_err_t err = __task_ctl_index(ctx, ID, &idx);
+    if (err != ESP_OK) return err;
+
+    __task_ctl_lock(ctx);
+    err = __task_arm(ctx, idx, delay, true);
+    __task_ctl_unlock(ctx);
+
+    return err;
+}
+
+static esp_err_t h2pca_ctx_task_start_periodic(h2pca_status * ctx, h2pca_task_id ID, uint32_t period) {
+    int32_t idx;
+    esp_err_t err = __task_ctl_index(ctx, ID, &idx);
+    if (err != ESP_OK) return err;
+
+    h2pca_task * tsk = POOL_TASK(&(ctx->cfg->tasks), idx);
+
+    __task_ctl_lock(ctx);
+    if (period > 0) {
+        portENTER_CRITICAL(&(ctx->tasks_lock));
+        tsk->period = period;
+        portEXIT_CRITICAL(&(ctx->tasks_lock));
+    }
+    err = __task_arm(ctx, idx, tsk->period, false);
+    __task_ctl_unlock(ctx);
+
+    return err;
+}
+
+static esp_err_t h2pca_ctx_task_set_period(h2pca_status * ctx, h2pca_task_id ID, uint32_t period) {
+    if ((ctx == NULL) || (period == 0)) return ESP_ERR_INVALID_ARG;
+    if (ctx->cfg == NULL) return ESP_ERR_INVALID_STATE;
+
+    int32_t idx = h2pca_task_pool_index_of(&(ctx->cfg->tasks), ID);
+    if (idx < 0) return ESP_ERR_NOT_FOUND;
+
+    return __task_set_period(ctx, idx, period);
+}
+
+static esp_err_t h2pca_ctx_task_cancel(h2pca_status * ctx, h2pca_task_id ID) {
+    int32_t idx;
+    esp_err_t err = __task_ctl_index(ctx, ID, &idx);
+    if (err != ESP_OK) return err;
+
+    h2pca_task * tsk = POOL_TASK(&(ctx->cfg->tasks), idx);
+
+    __task_ctl_lock(ctx);
+    esp_timer_stop(ctx->user_handles[idx]);
+
+    portENTER_CRITICAL(&(ctx->tasks_lock));
+    tsk->flags &= ~(H2PCA_TASK_ARMED | H2PCA_TASK_PAUSED | H2PCA_TASK_ONCE);
+    portEXIT_CRITICAL(&(ctx->tasks_lock));
+    __task_ctl_unlock(ctx);
+
+    return ESP_OK;
+}
+
+static esp_err_t h2pca_ctx_task_pause(h2pca_status * ctx, h2pca_task_id ID) {
+    int32_t idx;
+    esp_err_t err = __task_ctl_index(ctx, ID, &idx);
+    if (err != ESP_OK) return err;
+
+    h2pca_task * tsk = POOL_TASK(&(ctx->cfg->tasks), idx);
+
+    __task_ctl_lock(ctx);
+
+    if ((tsk->flags & (H2PCA_TASK_ARMED | H2PCA_TASK_PAUSED)) != H2PCA_TASK_ARMED) {
+        __task_ctl_unlock(ctx);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_timer_stop(ctx->user_handles[idx]);
+
+    portENTER_CRITICAL(&(ctx->tasks_lock));
+    /* one-shot task could be fired already */
+    if (tsk->flags & H2PCA_TASK_ARMED) {
+        tsk->flags |= H2PCA_TASK_PAUSED;
+        tsk->deadline -= esp_timer_get_time();
+        if (tsk->deadline < 0) tsk->deadline = 0;
+    }
+    portEXIT_CRITICAL(&(ctx->tasks_lock));
+    __task_ctl_unlock(ctx);
+
+    return ESP_OK;
+}
+
+static esp_err_t h2pca_ctx_task_resume(h2pca_status * ctx, h2pca_task_id ID) {
+    int32_t idx;
+    esp_err_t err = __task_ctl_index(ctx, ID, &idx);
+    if (err != ESP_OK) return err;
+
+    h2pca_task * tsk = POOL_TASK(&(ctx->cfg->tasks), idx);
+
+    __task_ctl_lock(ctx);
+
+    if ((tsk->flags & H2PCA_TASK_PAUSED) == 0)
+        err = ESP_ERR_INVALID_STATE;
+    else
+    if (tsk->flags & H2PCA_TASK_ONCE)
+        err = __task_arm(ctx, idx, tsk->deadline, true);
+    else
+        err = __task_arm(ctx, idx, tsk->period, false);
+
+    __task_ctl_unlock(ctx);
+
+    return err;
+}
+
+static esp_err_t h2pca_ctx_task_request(h2pca_status * ctx, h2pca_task_id ID, h2pca_task_req op, uint64_t value) {
+    if ((ctx == NULL) || (op <= H2PCA_TASK_REQ_NONE) || (op >= H2PCA_TASK_REQ_CNT))
+        return ESP_ERR_INVALID_ARG;
+    if (ctx->cfg == NULL) return ESP_ERR_INVALID_STATE;
+
+    int32_t idx = h2pca_task_pool_index_of(&(ctx->cfg->tasks), ID);
+    if (idx < 0) return ESP_ERR_NOT_FOUND;
+
+    h2pca_task * tsk = POOL_TASK(&(ctx->cfg->tasks), idx);
+
+    if (xPortInIsrContext()) {
+        portENTER_CRITICAL_ISR(&(ctx->tasks_lock));
+        tsk->req_op = op;
+        tsk->req_value = value;
+        ctx->tasks_req_pending = true;
+        portEXIT_CRITICAL_ISR(&(ctx->tasks_lock));
+    } else {
+        portENTER_CRITICAL(&(ctx->tasks_lock));
+        tsk->req_op = op;
+        tsk->req_value = value;
+        ctx->tasks_req_pending = true;
+        portEXIT_CRITICAL(&(ctx->tasks_lock));
+    }
+
+    return ESP_OK;
+}
+
+/* apply the control requests in the main task */
+static void __task_apply_requests(h2pca_status * ctx, int user_tasks_cnt) {
+    if (!ctx->tasks_req_pending) return;
+
+    portENTER_CRITICAL(&(ctx->tasks_lock));
+    ctx->tasks_req_pending = false;
+    portEXIT_CRITICAL(&(ctx->tasks_lock));
+
+    for (int i = 0; i < user_tasks_cnt; ++i) {
+        h2pca_task * tsk = POOL_TASK(&(ctx->cfg->tasks), i);
+
+        portENTER_CRITICAL(&(ctx->tasks_lock));
+        h2pca_task_req op = tsk->req_op;
+        uint64_t value = tsk->req_value;
+        tsk->req_op = H2PCA_TASK_REQ_NONE;
+        portEXIT_CRITICAL(&(ctx->tasks_lock));
+
+        esp_err_t err;
+        switch (op) {
+        case H2PCA_TASK_REQ_SCHEDULE_ONCE:
+            err = h2pca_ctx_task_schedule_once(ctx, tsk->ID, value);
+            break;
+        case H2PCA_TASK_REQ_START_PERIODIC:
+            err = h2pca_ctx_task_start_periodic(ctx, tsk->ID, (uint32_t) value);
+            break;
+        case H2PCA_TASK_REQ_SET_PERIOD:
+            err = h2pca_ctx_task_set_period(ctx, tsk->ID, (uint32_t) value);
+            break;
+        case H2PCA_TASK_REQ_CANCEL:
+            err = h2pca_ctx_task_cancel(ctx, tsk->ID);
+            break;
+        case H2PCA_TASK_REQ_PAUSE:
+            err = h2pca_ctx_task_pause(ctx, tsk->ID);
+            break;
+        case H2PCA_TASK_REQ_RESUME:
+            err = h2pca_ctx_task_resume(ctx, tsk->ID);
+            break;
+        default:
+            continue;
+        }
+
+        if (err != ESP_OK)
+            ESP_LOGW(tsk->TAG, "Control request %d failed: %d", op, err);
+    }
+}
+
+static int32_t h2pca_ctx_task_pending_count(h2pca_status * ctx) {
+    int32_t cnt = 0;
+
+    if ((ctx == NULL) || (ctx->cfg == NULL) || (ctx->user_handles == NULL)) return 0;
+
+    for (int32_t i = 0; i < ctx->cfg->tasks.cnt; ++i) {
+        if ((POOL_TASK(&(ctx->cfg->tasks), i)->flags & (H2PCA_TASK_ARMED | H2PCA_TASK_PAUSED)) == H2PCA_TASK_ARMED)
+            cnt++;
+    }
+
+    return cnt;
+}
+
+bool __std_on_incoming_msg(const cJSON * src, const cJSON * kind, const cJSON * iparams, const cJSON * msg_id) {
+    // do nothing
+    return true;
+}
+
+#ifndef CONFIG_H2PCA_NO_INMSGS
+/* incoming msgs de-duplication */
+
+/* is the msg id usable as the dedup key (string or number) */
+static bool __dedup_id_valid(const cJSON * msg_id) {
+    return (msg_id != NULL) &&
+           ((cJSON_IsString(msg_id) && (msg_id->valuestring != NULL)) || cJSON_IsNumber(msg_id));
+}
+
+/* hash of the (type, length, bytes) of the id followed by the (length,
+ * bytes) of the src, so no two different pairs are concatenated alike */
+static uint32_t __dedup_hash(uint32_t hash, const cJSON * src, const cJSON * msg_id) {
+    uint8_t type = cJSON_IsString(msg_id) ? 1 : 2;
+    const void * id = (type == 1) ? (const void *) msg_id->valuestring : (const void *) &(msg_id->valuedouble);
+    uint32_t id_len = (type == 1) ? strlen(msg_id->valuestring) : sizeof(double);
+    bool has_src = cJSON_IsString(src) && (src->valuestring != NULL);
+    uint32_t src_len = has_src ? strlen(src->valuestring) : 0;
+
+    hash = __fnv1a(hash, &type, sizeof(type));
+    hash = __fnv1a(hash, &id_len, sizeof(id_len));
+    hash = __fnv1a(hash, id, id_len);
+    hash = __fnv1a(hash, &src_len, sizeof(src_len));
+    if (has_src)
+        hash = __fnv1a(hash, src->valuestring, src_len);
+    return hash;
+}
+
+/* 64-bit fingerprint of the (src, id) pair. two hashes with different
+ * seeds, the low half feeds the filter */
+static uint64_t __dedup_key(const cJSON * src, const cJSON * msg_id) {
+    uint64_t key = ((uint64_t) __dedup_hash(DEDUP_SEED2, src, msg_id) << 32) |
+                   __dedup_hash(FNV_OFFSET_BASIS, src, msg_id);
+
+    /* zero marks the empty slot */
+    return (key != 0) ? key : 1;
+}
+
+#define DEDUP_H1(key) ((uint32_t) (key) & (H2PCA_DEDUP_FILTER_SIZE - 1))
+#define DEDUP_H2(key) (((uint32_t) (key) >> 16) & (H2PCA_DEDUP_FILTER_SIZE - 1))
+
+static bool __dedup_contains(uint64_t key) {
+    /* the filter has no false negatives */
+    if ((dedup_state.filter[DEDUP_H1(key)] == 0) ||
+        (dedup_state.filter[DEDUP_H2(key)] == 0))
+        return false;
+
+    for (int i = 0; i < H2PCA_DEDUP_RING_SIZE; ++i) {
+        if (dedup_state.ring[i] == key)
+            return true;
+    }
+    return false;
+}
+
+static void __dedup_add(uint64_t key) {
+    uint64_t * slot = &(dedup_state.ring[dedup_state.head & (H2PCA_DEDUP_RING_SIZE - 1)]);
+
+    if (*slot != 0) {
+        dedup_state.filter[DEDUP_H1(*slot)]--;
+        dedup_state.filter[DEDUP_H2(*slot)]--;
+    }
+
+    *slot = key;
+    dedup_state.filter[DEDUP_H1(key)]++;
+    dedup_state.filter[DEDUP_H2(key)]++;
+    dedup_state.head++;
+}
+
+/* h2pc proceeds incoming msgs without user arg - the context is passed aside */
+static h2pca_status * dedup_ctx = NULL;
+
+static bool __dedup_on_incoming_msg(const cJSON * src, const cJSON * kind, const cJSON * iparams, const cJSON * msg_id) {
+    h2pca_status * ctx = dedup_ctx;
+    h2pc_cb_next_msg cb = (ctx->cfg->on_next_inmsg != NULL) ? ctx->cfg->on_next_inmsg : &__std_on_incoming_msg;
+
+    /* msgs without usable id are not de-duplicated */
+    if (!__dedup_id_valid(msg_id))
+        return cb(src, kind, iparams, msg_id);
+
+    uint64_t key = __dedup_key(src, msg_id);
+
+    if (__dedup_contains(key)) {
+        ctx->dedup_hits++;
+        ESP_LOGD(ctx->cfg->LOG_TAG, "Duplicate incoming msg skipped");
+        return true;
+    }
+    ctx->dedup_misses++;
+
+    bool res = cb(src, kind, iparams, msg_id);
+    if (res)
+        __dedup_add(key);
+
+    return res;
+}
+
+static void __recieve_msgs(h2pca_status * ctx) {
+    TRACE(H2PCA_TRACE_REQ_BEGIN, H2PCA_TRACE_REQ_GET_MSGS, 0);
+    int res = h2pc_req_get_msgs_sync();
+    TRACE(H2PCA_TRACE_REQ_END, H2PCA_TRACE_REQ_GET_MSGS, res);
+    if (res == ESP_OK) {
+        ctx->last_alive = esp_timer_get_time();
+        h2pca_ctx_locked_CLR_STATE(ctx, MODE_RECIEVE_MSG);
+    }
+}
+
+#endif
+
+static void __send_msgs(h2pca_status * ctx) {
+    uint32_t batch = __om_flush(ctx);
+
+    /* nothing to send till the buckets are refilled */
+    if ((batch == 0) && !h2pc_om_locked_waiting())
+        return;
+
+    TRACE(H2PCA_TRACE_REQ_BEGIN, H2PCA_TRACE_REQ_SEND_MSGS, 0);
+    int res = h2pc_req_send_msgs_sync();
+    TRACE(H2PCA_TRACE_REQ_END, H2PCA_TRACE_REQ_SEND_MSGS, res);
+
+    int64_t now = esp_timer_get_time();
+    if (res == ESP_OK) {
+        ctx->last_alive = now;
+        __om_h2pc_done(ctx);
+        /* additive increase of the rate */
+        if (ctx->send_rate_scale < H2PCA_RATE_SCALE_FULL)
+            ctx->send_rate_scale += SEND_RATE_SCALE_STEP;
+        /* the rest of backlog is sent in the next steps */
+        if (h2pca_ctx_om_count(ctx) == 0)
+            h2pca_ctx_locked_CLR_STATE(ctx, MODE_SEND_MSG);
+    } else
+    /* multiplicative decrease of the rate if the host asks to retry.
+     * transport errors lead to reconnect, other tiers are not about load */
+    if ((res == H2PC_ERR_PROTOCOL) && (h2pc_get_protocol_errors_cnt() > 0) &&
+        (__classify_error(ctx, h2pc_get_last_error()) == H2PCA_RECOVER_RETRY)) {
+        ctx->send_rate_scale >>= 1;
+        if (ctx->send_rate_scale < SEND_RATE_SCALE_MIN)
+            ctx->send_rate_scale = SEND_RATE_SCALE_MIN;
+    }
+
+    if ((ctx->drain_start != 0) && (h2pca_ctx_om_count(ctx) == 0)) {
+        ctx->drain_time = now - ctx->drain_start;
+        ctx->drain_batches = ctx->batches - ctx->drain_batches_at;
+        ctx->drain_start = 0;
+        ESP_LOGI(ctx->cfg->LOG_TAG, "Backlog of %" PRId32 " msgs is drained in %" PRId64 " us in %" PRIu32 " batches",
+                                    ctx->drain_msgs, ctx->drain_time, ctx->drain_batches);
+    }
+}
+
+/* probe the idle connection. h2pc has no PING frame API, so the
+ * cheapest request (get msgs) is used. incoming msgs are proceeded
+ * in the next step. only transport failures are counted, the protocol
+ * error proves the link alive and is classified as usual.
+ * returns true if the connection is closed */
+static bool __keepalive(h2pca_status * ctx) {
+    uint32_t period = ctx->cfg->keepalive_period;
+    if (period == 0) return false;
+
+    int64_t now = esp_timer_get_time();
+    /* the link is proved alive by the real traffic */
+    if ((now - ctx->last_alive < period) || (now - ctx->keepalive_last < period))
+        return false;
+
+    ctx->keepalive_last = now;
+    ctx->keepalive_probes++;
+
+    TRACE(H2PCA_TRACE_REQ_BEGIN, H2PCA_TRACE_REQ_KEEPALIVE, 0);
+    int res = h2pc_get_connected() ? h2pc_req_get_msgs_sync() : ESP_FAIL;
+    TRACE(H2PCA_TRACE_REQ_END, H2PCA_TRACE_REQ_KEEPALIVE, res);
+
+    int64_t done = esp_timer_get_time();
+
+    if (((res == ESP_OK) || (res == H2PC_ERR_PROTOCOL)) && h2pc_get_connected()) {
+        ctx->last_alive = done;
+        ctx->keepalive_fails = 0;
+        ctx->keepalive_rtt = done - now;
+        if (ctx->keepalive_rtt > ctx->keepalive_rtt_max)
+            ctx->keepalive_rtt_max = ctx->keepalive_rtt;
+        if (res == ESP_OK) {
+            h2pca_ctx_locked_CLR_STATE(ctx, MODE_RECIEVE_MSG);
+            return false;
+        }
+        /* the host answered with an error */
+        __check_h2pc_errors(ctx, 0, 0);
+        return !h2pca_ctx_locked_CHK_STATE(ctx, HOST_CONNECTED_BIT);
+    }
+
+    if (ctx->keepalive_fails == 0)
+        ctx->keepalive_first_fail = now;
+    ctx->keepalive_fails++;
+    ESP_LOGW(ctx->cfg->LOG_TAG, "Keepalive failed (%d)", ctx->keepalive_fails);
+
+    if ((ctx->keepalive_fails >= ctx->cfg->keepalive_max_fails) || !h2pc_get_connected()) {
+        ctx->dead_conns++;
+        ctx->dead_detect_time = done - ctx->keepalive_first_fail;
+        ctx->keepalive_fails = 0;
+        ESP_LOGW(ctx->cfg->LOG_TAG, "Connection is dead, detected in %" PRId64 " us", ctx->dead_detect_time);
+        __disconnect_host(ctx);
+        return true;
+    }
+    return false;
+}
+
+/* telemetry */
+
+static void __telemetry_add_delta(cJSON * params, const char * key, uint32_t cur, uint32_t base, bool full) {
+    if (full)
+        cJSON_AddNumberToObject(params, key, cur);
     else
-        __disconnect_host();
+    if (cur != base)
+        cJSON_AddNumberToObject(params, key, cur - base);
+}
+
+/* returns true if the gauge is sent */
+static bool __telemetry_add_gauge(cJSON * params, const char * key, int32_t cur, int32_t base, int32_t tol, bool full) {
+    if (full || (cur - base > tol) || (base - cur > tol)) {
+        cJSON_AddNumberToObject(params, key, cur);
+        return true;
+    }
+    return false;
+}
+
+/* send the summary of performance counters. counters are sent as deltas
+ * since the last report, gauges - if changed since they were sent */
+static void __telemetry_report(h2pca_status * ctx) {
+    h2pca_telemetry_base * base = &(ctx->telemetry_base);
+    h2pca_telemetry_base cur = *base;
+    bool full = ((ctx->telemetry_seq % TELEMETRY_FULL_EVERY) == 0);
+
+    cJSON * params = cJSON_CreateObject();
+    if (params == NULL) return;
+
+    cJSON_AddNumberToObject(params, "n", ctx->telemetry_seq);
+    if (full)
+        cJSON_AddNumberToObject(params, "f", 1);
+
+    cur.overruns = ctx->loop_overruns;
+    cur.wifi_fails = ctx->wifi_fails;
+    cur.connect_fails = ctx->connect_fails;
+    cur.dead_conns = ctx->dead_conns;
+    cur.om_lost = ctx->om_shed + ctx->om_evicted;
+    cur.deadline_misses = __sync_deadline_misses(ctx);
+    cur.sync_aged = ctx->sync_aged;
+    cur.sync_carry_caps = ctx->sync_carry_caps;
+    cur.heap_kb = esp_get_free_heap_size() >> 10;
+    cur.heap_min_kb = esp_get_minimum_free_heap_size() >> 10;
+
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK)
+        cur.rssi = ap_info.rssi;
+
+    __telemetry_add_delta(params, "ov", cur.overruns, base->overruns, full);
+    __telemetry_add_delta(params, "we", cur.wifi_fails, base->wifi_fails, full);
+    __telemetry_add_delta(params, "ce", cur.connect_fails, base->connect_fails, full);
+    __telemetry_add_delta(params, "dc", cur.dead_conns, base->dead_conns, full);
+    __telemetry_add_delta(params, "ol", cur.om_lost, base->om_lost, full);
+    __telemetry_add_delta(params, "sm", cur.deadline_misses, base->deadline_misses, full);
+    __telemetry_add_delta(params, "sa", cur.sync_aged, base->sync_aged, full);
+    __telemetry_add_delta(params, "sc", cur.sync_carry_caps, base->sync_carry_caps, full);
+    /* the base of not sent gauge is kept to catch a slow drift */
+    if (!__telemetry_add_gauge(params, "hp", cur.heap_kb, base->heap_kb, 1, full))
+        cur.heap_kb = base->heap_kb;
+    if (!__telemetry_add_gauge(params, "hm", cur.heap_min_kb, base->heap_min_kb, 0, full))
+        cur.heap_min_kb = base->heap_min_kb;
+    if (!__telemetry_add_gauge(params, "rs", cur.rssi, base->rssi, 2, full))
+        cur.rssi = base->rssi;
+
+    /* queue depths */
+    if (ctx->om_peak > 0)
+        cJSON_AddNumberToObject(params, "oq", ctx->om_peak);
+    if (ctx->work_queue != NULL) {
+        UBaseType_t wq = uxQueueMessagesWaiting(ctx->work_queue);
+        if (wq > 0)
+            cJSON_AddNumberToObject(params, "wq", wq);
+    }
+
+    /* send pacing. max batch, last drain time (ms) and rate share */
+    if (ctx->batch_max_msgs > 0)
+        cJSON_AddNumberToObject(params, "bm", ctx->batch_max_msgs);
+    if (ctx->drain_time > 0)
+        cJSON_AddNumberToObject(params, "dt", ctx->drain_time / 1000);
+    if (ctx->send_rate_scale < H2PCA_RATE_SCALE_FULL)
+        cJSON_AddNumberToObject(params, "sr", ctx->send_rate_scale);
+
+    /* phase latencies. max and avg per phase */
+    int ph_max[H2PCA_PHASES_CNT];
+    int ph_avg[H2PCA_PHASES_CNT];
+    bool has_phases = false;
+    for (int i = 0; i < H2PCA_PHASES_CNT; ++i) {
+        h2pca_phase_stat * stat = &(ctx->phase_stats[i]);
+        ph_max[i] = stat->max;
+        ph_avg[i] = (stat->cnt > 0) ? (int)(stat->sum / stat->cnt) : 0;
+        if (stat->cnt > 0) has_phases = true;
+    }
+    if (has_phases) {
+        cJSON_AddItemToObject(params, "pm", cJSON_CreateIntArray(ph_max, H2PCA_PHASES_CNT));
+        cJSON_AddItemToObject(params, "pa", cJSON_CreateIntArray(ph_avg, H2PCA_PHASES_CNT));
+    }
+
+    /* never compete with the application msgs */
+    if (h2pca_ctx_om_add_msg_ex(ctx, H2PCA_TELEMETRY_KIND, NULL, params, H2PCA_OM_SHED) == ESP_OK) {
+        *base = cur;
+        memset(ctx->phase_stats, 0, sizeof(ctx->phase_stats));
+        ctx->om_peak = 0;
+        ctx->telemetry_seq++;
+    }
+}
+
+/* sync events dispatch */
+
+static int64_t __sync_deadline(h2pca_status * ctx, h2pca_task * tsk, int64_t now) {
+    if (tsk->sync_deadline > 0)
+        return tsk->sync_ready_at + tsk->sync_deadline;
+
+    /* the task without deadline gets one after waiting for several
+     * steps, so it is not starved by busy tasks with deadlines */
+    int64_t aging = (int64_t) ctx->cfg->main_loop_period * portTICK_PERIOD_MS * 1000 * SYNC_AGING_STEPS;
+    if (now - tsk->sync_ready_at >= aging)
+        return tsk->sync_ready_at + aging;
+
+    return INT64_MAX;
+}
+
+/* should task a be dispatched before task b */
+static bool __sync_before(h2pca_status * ctx, h2pca_task * a, h2pca_task * b, int64_t now) {
+    int64_t da = __sync_deadline(ctx, a, now);
+    int64_t db = __sync_deadline(ctx, b, now);
+
+    if (da != db) return da < db;
+    if (a->priority != b->priority) return a->priority > b->priority;
+    /* the longest waiting first */
+    return a->sync_ready_at < b->sync_ready_at;
 }
 
+/* call on_sync of pending tasks within the step budget.
+ * returns the count of carried over events */
+static int32_t __dispatch_sync(h2pca_status * ctx, int user_tasks_cnt) {
+    int64_t now = esp_timer_get_time();
+    int32_t cnt = 0;
+
+    /* insertion sort of pending tasks. stable for equal keys */
+    for (int i = 0; i < user_tasks_cnt; ++i) {
+        h2pca_task * tsk = POOL_TASK(&(ctx->cfg->tasks), i);
+        if (tsk->on_sync == NULL) continue;
+
+        /* the stamp is read before the state. the stamp set by the timer
+         * after the state check is not cleared then */
+        portENTER_CRITICAL(&(ctx->tasks_lock));
+        int64_t ready = tsk->sync_ready_at;
+        portEXIT_CRITICAL(&(ctx->tasks_lock));
+
+        if (!h2pca_ctx_locked_CHK_STATE(ctx, (tsk->apply_bitmask | tsk->req_bitmask))) {
+            if (ready != 0) {
+                portENTER_CRITICAL(&(ctx->tasks_lock));
+                if (tsk->sync_ready_at == ready)
+                    tsk->sync_ready_at = 0;
+                portEXIT_CRITICAL(&(ctx->tasks_lock));
+            }
+            continue;
+        }
+        /* the state is set outside the task callbacks */
+        if (ready == 0)
+            __sync_stamp(ctx, tsk, now);
+
+        int32_t j = cnt++;
+        while ((j > 0) && __sync_before(ctx, tsk, POOL_TASK(&(ctx->cfg->tasks), ctx->sync_order[j - 1]), now)) {
+            ctx->sync_order[j] = ctx->sync_order[j - 1];
+            j--;
+        }
+        ctx->sync_order[j] = i;
+    }
 
-static esp_err_t event_handler(void *ctx, system_event_t *event)
-{
-    switch (event->event_id) {
-    case SYSTEM_EVENT_STA_START:
-        ESP_LOGI(app.cfg->LOG_TAG, "SYSTEM_EVENT_STA_START");
-        ESP_ERROR_CHECK(esp_wifi_connect());
-        EXEC_CB(on_wifi_init);
-        break;
-    case SYSTEM_EVENT_STA_GOT_IP:
-        ESP_LOGI(app.cfg->LOG_TAG, "SYSTEM_EVENT_STA_GOT_IP");
-        ESP_LOGI(app.cfg->LOG_TAG, "got ip:%s", ip4addr_ntoa(&event->event_info.got_ip.ip_info.ip));
-        h2pca_locked_SET_STATE(WIFI_CONNECTED_BIT);
-        h2pca_locked_SET_STATE(MODE_SETIME);
-        app.wifi_connect_errors = 0;
+    uint32_t budget = ctx->cfg->sync_step_budget;
 
-        EXEC_CB(on_wifi_con);
-        break;
-    case SYSTEM_EVENT_STA_DISCONNECTED:
-        ESP_LOGI(app.cfg->LOG_TAG, "SYSTEM_EVENT_STA_DISCONNECTED");
+    for (int32_t k = 0; k < cnt; ++k) {
+        int32_t i = ctx->sync_order[k];
+        h2pca_task * tsk = POOL_TASK(&(ctx->cfg->tasks), i);
 
-        app.wifi_connect_errors++;
+        int64_t start = esp_timer_get_time();
+        if ((k > 0) && (budget > 0) && (start - now >= budget))
+            return cnt - k;
 
-        sntp_stop();
+        /* the state could be changed by the previous callbacks */
+        if (!h2pca_ctx_locked_CHK_STATE(ctx, (tsk->apply_bitmask | tsk->req_bitmask)))
+            continue;
+
+        if ((tsk->sync_deadline > 0) && (start > tsk->sync_ready_at + tsk->sync_deadline))
+            tsk->deadline_misses++;
+        else
+        if ((tsk->sync_deadline == 0) && (__sync_deadline(ctx, tsk, now) != INT64_MAX))
+            ctx->sync_aged++;
 
-        if (h2pca_locked_CHK_STATE(HOST_CONNECTED_BIT)) h2pc_disconnect_http2();
-        h2pca_locked_CLR_ALL_STATES();
+        portENTER_CRITICAL(&(ctx->tasks_lock));
+        tsk->sync_ready_at = 0;
+        portEXIT_CRITICAL(&(ctx->tasks_lock));
 
-        h2pca_locked_CLR_STATE(WIFI_CONNECTED_BIT);
-        h2pc_reset_buffers();
+        uint32_t p = tsk->period;
+        int errs = h2pc_get_protocol_errors_cnt();
 
-        EXEC_CB(on_wifi_dis);
+        tsk->on_sync(tsk->ID, h2pca_ctx_locked_GET_STATES(ctx), tsk->user_data, &p);
+        __check_h2pc_errors(ctx, 0, errs);
 
-        break;
-    default:
-        break;
+        if (p != tsk->period)
+            __task_set_period(ctx, i, p);
     }
-    return ESP_OK;
+
+    return 0;
 }
 
-static void initialise_wifi()
-{
-    tcpip_adapter_init();
-    ESP_ERROR_CHECK( esp_event_loop_init(event_handler, NULL) );
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK( esp_wifi_init(&cfg) );
-    ESP_ERROR_CHECK( esp_wifi_set_storage(WIFI_STORAGE_RAM) );
-    wifi_config_t wifi_config;
-    memset(&wifi_config, 0x00, sizeof(wifi_config_t));
+/* duty-cycle mode */
 
-    char * value = get_cfg_value(CFG_SSID_NAME);
-    if (value != NULL) {
-        strcpy((char *) &(wifi_config.sta.ssid[0]), value);
-        ESP_LOGD(app.cfg->LOG_TAG, "SSID setted from json config");
-    } else {
-        strcpy((char *) &(wifi_config.sta.ssid[0]), APP_WIFI_SSID);
-        ESP_LOGD(app.cfg->LOG_TAG, "SSID setted from flash config");
+/* init deadlines for user tasks. returns the bitmask of tasks
+ * that are due to run in this cycle. the deadline of the due task
+ * is advanced when it is fired */
+static uint32_t __duty_init_deadlines(h2pca_status * ctx, int user_tasks_cnt) {
+    int64_t now = __rtc_now();
+    uint32_t due = 0;
+
+    if (user_tasks_cnt > H2PCA_RTC_MAX_TASKS) {
+        ESP_LOGW(ctx->cfg->LOG_TAG, "Only %d tasks can be scheduled in duty-cycle mode", H2PCA_RTC_MAX_TASKS);
+        user_tasks_cnt = H2PCA_RTC_MAX_TASKS;
     }
-    value = get_cfg_value(CFG_SSID_PASSWORD);
-    if (value != NULL) {
-        strcpy((char *) &(wifi_config.sta.password[0]), value);
-        ESP_LOGD(app.cfg->LOG_TAG, "Password setted from json config");
-    } else {
-        strcpy((char *) &(wifi_config.sta.password[0]), APP_WIFI_PASS);
-        ESP_LOGD(app.cfg->LOG_TAG, "Password setted from flash config");
+
+    for (int i = 0; i < user_tasks_cnt; ++i) {
+        h2pca_task * tsk = POOL_TASK(&(ctx->cfg->tasks), i);
+
+        if (!ctx->woken_from_sleep || (i >= rtc_state.tasks_cnt)) {
+            rtc_state.deadlines[i] = now + tsk->period;
+        } else
+        if (rtc_state.deadlines[i] <= now) {
+            due |= (1 << i);
+        }
     }
+    rtc_state.tasks_cnt = user_tasks_cnt;
 
-    ESP_LOGI(app.cfg->LOG_TAG, "Setting WiFi configuration SSID %s...", wifi_config.sta.ssid);
-    ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA) );
-    ESP_ERROR_CHECK( esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) );
-    ESP_ERROR_CHECK( esp_wifi_start() );
+    return due;
 }
 
-
-void __msgs_get_cb(void* arg)
-{
-    ESP_LOGD(app.cfg->LOG_TAG, "Recieve msgs fired");
-    bool isempty = h2pc_im_locked_waiting();
-    if (isempty) {
-        if (h2pca_locked_CHK_STATE(HOST_CONNECTED_BIT))
-            h2pca_locked_SET_STATE(MODE_RECIEVE_MSG);
+/* fire due tasks as soon as their required states are set */
+static uint32_t __duty_fire_due_tasks(h2pca_status * ctx, uint32_t due) {
+    for (int i = 0; i < rtc_state.tasks_cnt; ++i) {
+        if (due & (1 << i)) {
+            h2pca_task * tsk = POOL_TASK(&(ctx->cfg->tasks), i);
+
+            if (h2pca_ctx_locked_CHK_STATE(ctx, tsk->req_bitmask)) {
+                __user_task_cb(tsk);
+                /* not fired task stays due in the next cycle */
+                rtc_state.deadlines[i] = __rtc_now() + tsk->period;
+                due &= ~(1 << i);
+            }
+        }
     }
+    return due;
 }
 
-void __msgs_send_cb(void* arg)
-{
-    ESP_LOGD(app.cfg->LOG_TAG, "Send msgs fired");
+/* check that all work in the current cycle is done */
+static bool __duty_cycle_done(h2pca_status * ctx, uint32_t due, int user_tasks_cnt) {
+    if (due != 0) return false;
 
-    bool isnempty = h2pc_om_locked_waiting();
-    if (isnempty) {
-        if (h2pca_locked_CHK_STATE(HOST_CONNECTED_BIT))
-            h2pca_locked_SET_STATE(MODE_SEND_MSG);
-    }
-}
+    /* authorized and received msgs at least once */
+    h2pca_state st = h2pca_ctx_locked_GET_STATES(ctx);
+    if ((st & AUTHORIZED_BIT) == 0) return false;
+    if ((st & (MODE_AUTH | MODE_RECIEVE_MSG | MODE_SEND_MSG)) != 0) return false;
 
-void __user_task_cb(void* arg)
-{
-    h2pca_task * tsk = (h2pca_task *)arg;
-    ESP_LOGD(tsk->TAG, "User task fired");
+    /* incoming msgs are drained */
+    if (!h2pc_im_locked_waiting()) return false;
 
-    if (h2pca_locked_CHK_STATE(tsk->req_bitmask)) {
+    /* outgoing msgs are sent */
+    if (h2pc_om_locked_waiting() || (h2pca_ctx_om_count(ctx) > 0)) {
+        h2pca_ctx_locked_SET_STATE(ctx, MODE_SEND_MSG);
+        return false;
+    }
 
-        if (tsk->on_time)
-            tsk->on_time(tsk->ID, tsk->user_data);
-        else
-            h2pca_locked_SET_STATE(tsk->apply_bitmask);
+    /* no sync events are pending */
+    for (int i = 0; i < user_tasks_cnt; ++i) {
+        h2pca_task * tsk = POOL_TASK(&(ctx->cfg->tasks), i);
 
+        if (tsk->on_sync && tsk->apply_bitmask &&
+            ((st & (tsk->apply_bitmask | tsk->req_bitmask)) == (tsk->apply_bitmask | tsk->req_bitmask)))
+            return false;
     }
-}
 
-bool __std_on_incoming_msg(const cJSON * src, const cJSON * kind, const cJSON * iparams, const cJSON * msg_id) {
-    // do nothing
     return true;
 }
 
-static void __recieve_msgs() {
-    int res = h2pc_req_get_msgs_sync();
-    if (res == ESP_OK)
-        h2pca_locked_CLR_STATE(MODE_RECIEVE_MSG);
-}
+static void __duty_enter_sleep(h2pca_status * ctx) {
+    int64_t now = __rtc_now();
+    int64_t next = now + ctx->cfg->recv_msgs_period;
 
-static void __send_msgs() {
-    int res = h2pc_req_send_msgs_sync();
-    if (res == ESP_OK)
-        h2pca_locked_CLR_STATE(MODE_SEND_MSG);
+    for (int i = 0; i < rtc_state.tasks_cnt; ++i) {
+        if (rtc_state.deadlines[i] < next)
+            next = rtc_state.deadlines[i];
+    }
+
+    int64_t sleep_time = next - now;
+    if (sleep_time < ctx->cfg->duty_cycle_min_sleep)
+        sleep_time = ctx->cfg->duty_cycle_min_sleep;
+
+    rtc_state.states = h2pca_ctx_locked_GET_STATES(ctx) & ~MODE_VOLATILE;
+    __rtc_save_om(ctx);
+
+    __disconnect_host(ctx);
+    esp_wifi_stop();
+
+    ctx->awake_time = esp_timer_get_time();
+    rtc_state.awake_time = ctx->awake_time;
+    rtc_state.clock = now + sleep_time;
+
+    ESP_LOGI(ctx->cfg->LOG_TAG, "Awake %" PRId64 " us, sleep for %" PRId64 " us", ctx->awake_time, sleep_time);
+
+    esp_sleep_enable_timer_wakeup(sleep_time);
+    esp_deep_sleep_start();
 }
 
 static void __main_task(void *args)
 {
+    h2pca_status * ctx = (h2pca_status *) args;
     esp_err_t err;
+#ifndef CONFIG_H2PCA_NO_BLE_CONFIG
     cJSON * loc_cfg = NULL;
+#endif
 
-    err = nvs_open(DEVICE_CONFIG, NVS_READWRITE, &(app.nvs_h));
+    h2pca_register_task_stack(MAIN_TASK_NAME, xTaskGetCurrentTaskHandle(), ctx->main_stack_size);
+
+    err = nvs_open(DEVICE_CONFIG, NVS_READWRITE, &(ctx->nvs_h));
     if (err == ESP_OK) {
+#ifndef CONFIG_H2PCA_NO_BLE_CONFIG
         size_t required_size;
-        err = nvs_get_str(app.nvs_h, DEVICE_CONFIG, NULL, &required_size);
+        err = nvs_get_str(ctx->nvs_h, DEVICE_CONFIG, NULL, &required_size);
         if (err == ESP_OK) {
-            char * cfg_str = malloc(required_size);
+            char * cfg_str = __mem_alloc(H2PCA_MEM_APP, required_size);
             if (cfg_str == NULL)
                 ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
-            nvs_get_str(app.nvs_h, DEVICE_CONFIG, cfg_str, &required_size);
+            nvs_get_str(ctx->nvs_h, DEVICE_CONFIG, cfg_str, &required_size);
             loc_cfg = cJSON_Parse(cfg_str);
-            free(cfg_str);
+            __mem_free(H2PCA_MEM_APP, cfg_str);
             ESP_LOGD(DEVICE_CONFIG, "JSON cfg founded");
             #ifdef LOG_DEBUG
             esp_log_buffer_char(DEVICE_CONFIG, cfg_str, strlen(cfg_str));
             #endif
         }
-        EXEC_CB(on_read_nvs, app.nvs_h);
+#endif
+        EXEC_CB(on_read_nvs, ctx->nvs_h);
     }
 
+#ifndef CONFIG_H2PCA_NO_BLE_CONFIG
     if (loc_cfg == NULL) {
         loc_cfg = cJSON_CreateArray();
         if (loc_cfg == NULL)
             ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
 
         cJSON * cfg_item = cJSON_CreateObject();
-        cJSON_AddStringToObject(cfg_item, get_cfg_id(CFG_DEVICE_NAME), app.mac_str);
+        cJSON_AddStringToObject(cfg_item, get_cfg_id(CFG_DEVICE_NAME), ctx->mac_str);
         cJSON_AddItemToArray(loc_cfg, cfg_item);
         cfg_item = cJSON_CreateObject();
         cJSON_AddStringToObject(cfg_item, get_cfg_id(CFG_USER_NAME), HTTP2_SERVER_NAME);
@@ -515,17 +2910,18 @@ static void __main_task(void *args)
     }
 
     if (loc_cfg == NULL) {
-        ESP_LOGE(app.cfg->LOG_TAG, "No config found");
+        ESP_LOGE(ctx->cfg->LOG_TAG, "No config found");
         ESP_ERROR_CHECK(ESP_ERR_INVALID_STATE);
     }
 
-    set_ble_config_params(app.cfg->ble_cfg.count, app.cfg->ble_cfg.ids, app.cfg->ble_cfg.cfgs);
+    set_ble_config_params(ctx->cfg->ble_cfg.count, ctx->cfg->ble_cfg.ids, ctx->cfg->ble_cfg.cfgs);
 
     EXEC_CB(on_ble_cfg_start);
 
     error_t ret = initialize_ble(loc_cfg);
     cJSON_Delete(loc_cfg);
-    if (ret == OK) {
+    /* no need to wait for ble config after the deep sleep */
+    if ((ret == OK) && !(ctx->cfg->duty_cycle && ctx->woken_from_sleep)) {
         start_ble_config_round();
         while ( ble_config_proceed() ) {
             vTaskDelay(1000);
@@ -534,8 +2930,8 @@ static void __main_task(void *args)
 
         if (WC_CFG_VALUES != NULL) {
             char * cfg_str = cJSON_PrintUnformatted(WC_CFG_VALUES);
-            nvs_set_str(app.nvs_h, DEVICE_CONFIG, cfg_str);
-            nvs_commit(app.nvs_h);
+            nvs_set_str(ctx->nvs_h, DEVICE_CONFIG, cfg_str);
+            nvs_commit(ctx->nvs_h);
 
             #ifdef LOG_DEBUG
             esp_log_buffer_char(DEVICE_CONFIG, cfg_str, strlen(cfg_str));
@@ -544,49 +2940,100 @@ static void __main_task(void *args)
             cJSON_free(cfg_str);
         }
     }
-    nvs_close(app.nvs_h);
+#endif
+    nvs_close(ctx->nvs_h);
 
+#ifndef CONFIG_H2PCA_NO_BLE_CONFIG
     EXEC_CB(on_ble_cfg_finished);
+#endif
 
-    ESP_ERROR_CHECK(h2pc_initialize(app.cfg->h2pcmode));
-    initialise_wifi();
+    ESP_ERROR_CHECK(h2pc_initialize(ctx->cfg->h2pcmode));
+    initialise_wifi(ctx);
 
     /* init system timers */
-    esp_timer_create_args_t timer_args;
+    esp_timer_create_args_t timer_args = { 0 };
 
-    app.sys_handles = (esp_timer_handle_t*) malloc(sizeof(esp_timer_handle_t) * MAX_SYS_TASKS);
+    ctx->sys_handles = (esp_timer_handle_t*) __mem_calloc(H2PCA_MEM_APP, MAX_SYS_TASKS, sizeof(esp_timer_handle_t));
 
+    timer_args.arg = ctx;
+#ifndef CONFIG_H2PCA_NO_INMSGS
     timer_args.callback = &__msgs_get_cb;
-    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &(app.sys_handles[SYS_TASK_RECV])));
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &(ctx->sys_handles[SYS_TASK_RECV])));
+#endif
 
     timer_args.callback = &__msgs_send_cb;
-    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &(app.sys_handles[SYS_TASK_SEND])));
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &(ctx->sys_handles[SYS_TASK_SEND])));
+
+    if (ctx->cfg->telemetry_period > 0) {
+        timer_args.callback = &__telemetry_cb;
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &(ctx->sys_handles[SYS_TASK_TELEMETRY])));
+    }
 
     /* start system timers */
-    esp_timer_start_periodic(app.sys_handles[SYS_TASK_RECV], app.cfg->recv_msgs_period);
-    esp_timer_start_periodic(app.sys_handles[SYS_TASK_SEND], app.cfg->send_msgs_period);
+#ifndef CONFIG_H2PCA_NO_INMSGS
+    esp_timer_start_periodic(ctx->sys_handles[SYS_TASK_RECV], ctx->cfg->recv_msgs_period);
+#endif
+    esp_timer_start_periodic(ctx->sys_handles[SYS_TASK_SEND], ctx->cfg->send_msgs_period);
+    if (ctx->cfg->telemetry_period > 0)
+        esp_timer_start_periodic(ctx->sys_handles[SYS_TASK_TELEMETRY], ctx->cfg->telemetry_period);
 
     /* init user timers */
 
-    int user_tasks_cnt = app.cfg->tasks.cnt;
+#ifdef CONFIG_H2PCA_NO_USER_TASKS
+    /* the code of user tasks is eliminated as dead */
+    const int user_tasks_cnt = 0;
+#else
+    int user_tasks_cnt = ctx->cfg->tasks.cnt;
+#endif
+    uint32_t due_tasks = 0;
+
+    if (user_tasks_cnt > 0) {
+        ctx->sync_order = (int32_t *) __mem_alloc(H2PCA_MEM_APP, sizeof(int32_t) * user_tasks_cnt);
+        if (ctx->sync_order == NULL)
+            ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    }
+
+    /* tasks are fired with the timers and with the duty deadlines */
+    for (int i = 0; i < user_tasks_cnt; ++i)
+        POOL_TASK(&(ctx->cfg->tasks), i)->owner = ctx;
 
+    if (ctx->cfg->duty_cycle) {
+        /* user tasks are fired by deadlines once per cycle */
+        due_tasks = __duty_init_deadlines(ctx, user_tasks_cnt);
+    } else
     if (user_tasks_cnt > 0) {
+        /* the control calls wait for all timers created */
+        __task_ctl_lock(ctx);
 
-        app.user_handles = (esp_timer_handle_t*) malloc(sizeof(esp_timer_handle_t) * user_tasks_cnt);
+        ctx->user_handles = (esp_timer_handle_t*) __mem_alloc(H2PCA_MEM_APP, sizeof(esp_timer_handle_t) * user_tasks_cnt);
 
-        if (app.user_handles == NULL)
+        if (ctx->user_handles == NULL)
             ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
 
+        __start_workers(ctx);
+
         for (int i = 0; i < user_tasks_cnt; ++i) {
-            h2pca_task * tsk = app.cfg->tasks.tasks[i];
+            h2pca_task * tsk = POOL_TASK(&(ctx->cfg->tasks), i);
 
             timer_args.callback = &__user_task_cb;
             timer_args.arg = tsk;
 
-            ESP_ERROR_CHECK(esp_timer_create(&timer_args, &(app.user_handles[i])));
-
-            esp_timer_start_periodic(app.user_handles[i], tsk->period);
+            ESP_ERROR_CHECK(esp_timer_create(&timer_args, &(ctx->user_handles[i])));
+
+            switch (tsk->mode) {
+            case H2PCA_TASK_PERIODIC:
+                __task_arm(ctx, i, tsk->period, false);
+                break;
+            case H2PCA_TASK_ONESHOT:
+                __task_arm(ctx, i, tsk->period, true);
+                break;
+            default:
+                /* deferred tasks are started by user */
+                break;
+            }
         }
+
+        __task_ctl_unlock(ctx);
     }
 
 
@@ -595,74 +3042,128 @@ static void __main_task(void *args)
     int connectDelay = RECONNECT_TIMEOUT;
     int wifiDisconnectedTime = 0;
     int hostDisconnectedTime = 0;
+    int sync_carried_steps = 0;
+    uint32_t loop_period = ctx->cfg->main_loop_period;
+
+    if (ctx->cfg->duty_cycle) {
+        /* minimize wake-to-sleep time */
+        connectDelay = 0;
+        loop_period = 1;
+    }
 
     while (1)
     {
         if (connectDelay > 0)
-            connectDelay -= app.cfg->main_loop_period;
+            connectDelay -= loop_period;
+
+        __phase_begin(ctx, H2PCA_TRACE_PH_STEP);
 
         EXEC_CB(on_begin_step);
 
-        if (h2pca_locked_CHK_STATE(WIFI_CONNECTED_BIT)) {
+        if (h2pca_ctx_locked_CHK_STATE(ctx, WIFI_CONNECTED_BIT)) {
 
             wifiDisconnectedTime = 0;
 
-            if (h2pca_locked_CHK_STATE(MODE_SETIME)) {
+            if (h2pca_ctx_locked_CHK_STATE(ctx, MODE_SETIME)) {
                 /* Set current time: proper system time is required for TLS based
                  * certificate verification.
                  */
                 set_time();
-                h2pca_locked_CLR_STATE(MODE_SETIME);
+                h2pca_ctx_locked_CLR_STATE(ctx, MODE_SETIME);
             }
 
 
-            if (h2pca_locked_CHK_STATE(HOST_CONNECTED_BIT)) {
+            if (h2pca_ctx_locked_CHK_STATE(ctx, HOST_CONNECTED_BIT)) {
 
                 hostDisconnectedTime = 0;
 
                 /* authorize the device on server */
-                if (h2pca_locked_CHK_STATE(MODE_AUTH)) {
-                    __send_authorize();
-                    __check_h2pc_errors();
+                if (__step_ready(ctx, MODE_AUTH)) {
+                    __phase_begin(ctx, H2PCA_TRACE_PH_AUTH);
+                    __send_authorize(ctx);
+                    __check_h2pc_errors(ctx, MODE_AUTH, 0);
+                    __phase_end(ctx, H2PCA_TRACE_PH_AUTH);
                 }
+#ifdef CONFIG_H2PCA_NO_INMSGS
+                /* drop msgs fetched by keepalive probes */
+                h2pc_im_proceed(&__std_on_incoming_msg, ctx->cfg->inmsgs_proceed_chunk);
+#else
                 /* gathering incoming msgs from server */
-                if (h2pca_locked_CHK_STATE(MODE_RECIEVE_MSG)) {
-                    esp_timer_stop(app.sys_handles[SYS_TASK_RECV]);
-                    __recieve_msgs();
-                    __check_h2pc_errors();
-                    esp_timer_start_periodic(app.sys_handles[SYS_TASK_RECV], app.cfg->recv_msgs_period);
+                if (__step_ready(ctx, MODE_RECIEVE_MSG)) {
+                    __phase_begin(ctx, H2PCA_TRACE_PH_RECV);
+                    esp_timer_stop(ctx->sys_handles[SYS_TASK_RECV]);
+                    __recieve_msgs(ctx);
+                    __check_h2pc_errors(ctx, MODE_RECIEVE_MSG, 0);
+                    esp_timer_start_periodic(ctx->sys_handles[SYS_TASK_RECV], ctx->cfg->recv_msgs_period);
+                    __phase_end(ctx, H2PCA_TRACE_PH_RECV);
                 }
                 /* proceed incoming messages */
+                __phase_begin(ctx, H2PCA_TRACE_PH_INMSGS);
                 EXEC_CB(on_before_inmsgs);
-                if (app.cfg->on_next_inmsg)
-                    h2pc_im_proceed(app.cfg->on_next_inmsg, app.cfg->inmsgs_proceed_chunk);
+                if (ctx->cfg->inmsgs_dedup) {
+                    dedup_ctx = ctx;
+                    h2pc_im_proceed(&__dedup_on_incoming_msg, ctx->cfg->inmsgs_proceed_chunk);
+                } else
+                if (ctx->cfg->on_next_inmsg)
+                    h2pc_im_proceed(ctx->cfg->on_next_inmsg, ctx->cfg->inmsgs_proceed_chunk);
                 else
-                    h2pc_im_proceed(&__std_on_incoming_msg, app.cfg->inmsgs_proceed_chunk);
+                    h2pc_im_proceed(&__std_on_incoming_msg, ctx->cfg->inmsgs_proceed_chunk);
                 EXEC_CB(on_after_inmsgs);
+                __phase_end(ctx, H2PCA_TRACE_PH_INMSGS);
+#endif
 
                 /* send outgoing messages */
-                if (h2pca_locked_CHK_STATE(MODE_SEND_MSG)) {
-                    esp_timer_stop(app.sys_handles[SYS_TASK_SEND]);
-                    __send_msgs();
-                    __check_h2pc_errors();
-                    esp_timer_start_periodic(app.sys_handles[SYS_TASK_SEND], app.cfg->send_msgs_period);
+                if (__step_ready(ctx, MODE_SEND_MSG)) {
+                    __phase_begin(ctx, H2PCA_TRACE_PH_SEND);
+                    esp_timer_stop(ctx->sys_handles[SYS_TASK_SEND]);
+                    __send_msgs(ctx);
+                    __check_h2pc_errors(ctx, MODE_SEND_MSG, 0);
+                    esp_timer_start_periodic(ctx->sys_handles[SYS_TASK_SEND], ctx->cfg->send_msgs_period);
+                    __phase_end(ctx, H2PCA_TRACE_PH_SEND);
                 }
+                /* send telemetry if the queue is low. a busy device reports
+                 * after several skipped periods */
+                if (ctx->telemetry_due && !ctx->om_pressure &&
+                    (__om_low(ctx) || (ctx->telemetry_skipped >= TELEMETRY_MAX_SKIPPED)) &&
+                    h2pca_ctx_locked_CHK_STATE(ctx, AUTHORIZED_BIT)) {
+                    ctx->telemetry_due = false;
+                    ctx->telemetry_skipped = 0;
+                    __telemetry_report(ctx);
+                }
+
+                /* probe the idle connection */
+                if (h2pca_ctx_locked_CHK_STATE(ctx, AUTHORIZED_BIT) && __keepalive(ctx))
+                    connectDelay = 0; // reconnect at once
+
+#ifdef CONFIG_WC_USE_IO_STREAMS
+                /* upload media frames. limited per step to not starve messaging */
+                if (h2pca_ctx_locked_CHK_STATE(ctx, AUTHORIZED_BIT)) {
+                    __phase_begin(ctx, H2PCA_TRACE_PH_STREAM);
+                    int errs = h2pc_get_protocol_errors_cnt();
+                    /* a failed upload is checked as well */
+                    if (__stream_frames(ctx) > 0)
+                        __check_h2pc_errors(ctx, 0, errs);
+                    __phase_end(ctx, H2PCA_TRACE_PH_STREAM);
+                }
+#endif
 
             } else {
 
-                hostDisconnectedTime += app.cfg->main_loop_period;
+                hostDisconnectedTime += loop_period;
 
                 if (hostDisconnectedTime > (5400 * configTICK_RATE_HZ))
                     ESP_ERROR_CHECK(ESP_ERR_INVALID_STATE); // drop to deep reload if no connection to host over 90 minutes
 
                 if (connectDelay <= 0) {
 
-                    __connect_to_http2();
+                    __phase_begin(ctx, H2PCA_TRACE_PH_CONNECT);
+                    __connect_to_http2(ctx);
+                    __phase_end(ctx, H2PCA_TRACE_PH_CONNECT);
 
-                    if (app.connect_errors > 10) {
+                    if (ctx->connect_errors > 10) {
                         connectDelay = 300 * configTICK_RATE_HZ; // 5 minutes
-                    } else if (app.connect_errors > 0) {
-                        connectDelay = app.connect_errors * 10 * configTICK_RATE_HZ;
+                    } else if (ctx->connect_errors > 0) {
+                        connectDelay = ctx->connect_errors * 10 * configTICK_RATE_HZ;
                     } else
                         connectDelay = RECONNECT_TIMEOUT;
                 }
@@ -670,88 +3171,135 @@ static void __main_task(void *args)
             }
 
         } else {
-            wifiDisconnectedTime += app.cfg->main_loop_period;
+            wifiDisconnectedTime += loop_period;
 
             if (wifiDisconnectedTime > (900 * configTICK_RATE_HZ))
                 ESP_ERROR_CHECK(ESP_ERR_INVALID_STATE); // drop to deep reload if no connection to AP over 15 minutes
 
-            if ((connectDelay <= 0) && (app.wifi_connect_errors)) {
+            if ((connectDelay <= 0) && (ctx->wifi_connect_errors)) {
 
-                app.wifi_connect_errors = 0;
-                ESP_ERROR_CHECK(esp_wifi_connect());
+                ctx->wifi_connect_errors = 0;
+                ESP_ERROR_CHECK(__wifi_connect(ctx));
 
                 connectDelay = RECONNECT_TIMEOUT; // 30 sec timeout between two wifi connection attempts
             }
         }
 
-        for (int i = 0; i < user_tasks_cnt; ++i) {
-            h2pca_task * tsk = app.cfg->tasks.tasks[i];
+        __task_apply_requests(ctx, user_tasks_cnt);
+
+        __phase_begin(ctx, H2PCA_TRACE_PH_SYNC);
+        /* the events kept pending by on_sync are carried over for a few
+         * steps only, then the loop period is applied */
+        bool sync_carried = (__dispatch_sync(ctx, user_tasks_cnt) > 0);
+        if (sync_carried && (sync_carried_steps >= SYNC_MAX_CARRIED_STEPS)) {
+            ctx->sync_carry_caps++;
+            sync_carried = false;
+        }
+        sync_carried_steps = sync_carried ? (sync_carried_steps + 1) : 0;
+        __phase_end(ctx, H2PCA_TRACE_PH_SYNC);
 
-            if (h2pca_locked_CHK_STATE((tsk->apply_bitmask | tsk->req_bitmask))) {
-                if (tsk->on_sync) {
-                    uint32_t p = tsk->period;
+        EXEC_CB(on_finish_step);
 
-                    tsk->on_sync(tsk->ID, h2pca_locked_GET_STATES(), tsk->user_data, &p);
-                    __check_h2pc_errors();
+        uint32_t step_time = __phase_end(ctx, H2PCA_TRACE_PH_STEP);
+        if (!ctx->cfg->duty_cycle && (step_time > loop_period * portTICK_PERIOD_MS * 1000))
+            ctx->loop_overruns++;
 
-                    if (p != tsk->period) {
-                        esp_timer_stop(app.user_handles[i]);
-                        tsk->period = p;
-                        esp_timer_start_periodic(app.user_handles[i], p);
-                    }
-                }
+        if (ctx->cfg->duty_cycle) {
+            due_tasks = __duty_fire_due_tasks(ctx, due_tasks);
 
+            if (__duty_cycle_done(ctx, due_tasks, user_tasks_cnt)) {
+                __duty_enter_sleep(ctx);
+            } else
+            if (esp_timer_get_time() > ctx->cfg->duty_cycle_max_awake) {
+                ESP_LOGW(ctx->cfg->LOG_TAG, "Duty cycle is not finished in time");
+                __duty_enter_sleep(ctx);
             }
         }
 
-        EXEC_CB(on_finish_step);
-
-        vTaskDelay(app.cfg->main_loop_period);
+        /* do not delay the carried over sync events */
+        vTaskDelay(sync_carried ? 1 : loop_period);
     }
 
     EXEC_CB(on_finish_loop);
 
-    __disconnect_host();
+    __disconnect_host(ctx);
 
     h2pc_finalize();
 
+    h2pca_unregister_task_stack(xTaskGetCurrentTaskHandle());
     vTaskDelete(NULL);
 }
 
-void h2pca_start(uint32_t heap_sz) {
+static esp_err_t h2pca_ctx_start(h2pca_status * ctx, uint32_t heap_sz) {
+    if (ctx == NULL) return ESP_ERR_INVALID_ARG;
+
     if (heap_sz == 0) {
         heap_sz = DEFAULT_HEAP_SIZE;
     }
 
-    xTaskCreate(&__main_task, MAIN_TASK_NAME, heap_sz, NULL, 5, NULL);
+    ctx->main_stack_size = heap_sz;
+
+    if (xTaskCreate(&__main_task, MAIN_TASK_NAME, heap_sz, ctx, 5, NULL) != pdPASS)
+        return ESP_ERR_NO_MEM;
+
+    return ESP_OK;
 }
 
-void h2pca_loop() {
-    __main_task(NULL);
+static esp_err_t h2pca_ctx_loop(h2pca_status * ctx) {
+    if (ctx == NULL) return ESP_ERR_INVALID_ARG;
+
+    __main_task(ctx);
+
+    return ESP_OK;
 }
 
-esp_err_t h2pca_done() {
-    for (int i = 0; i < MAX_SYS_TASKS; ++i) {
-        if (app.sys_handles[i] != 0) {
-            esp_timer_stop(app.sys_handles[i]);
-            esp_timer_delete(app.sys_handles[i]);
+static esp_err_t h2pca_ctx_done(h2pca_status * ctx) {
+    if (ctx == NULL) return ESP_ERR_INVALID_ARG;
+
+    if (ctx->sys_handles != NULL) {
+        for (int i = 0; i < MAX_SYS_TASKS; ++i) {
+            if (ctx->sys_handles[i] != 0) {
+                esp_timer_stop(ctx->sys_handles[i]);
+                esp_timer_delete(ctx->sys_handles[i]);
+            }
         }
     }
-    for (int i = 0; i < app.cfg->tasks.cnt; ++i) {
-        if (app.user_handles[i] != 0) {
-            esp_timer_stop(app.user_handles[i]);
-            esp_timer_delete(app.user_handles[i]);
+    if ((ctx->user_handles != NULL) && (ctx->cfg != NULL)) {
+        for (int i = 0; i < ctx->cfg->tasks.cnt; ++i) {
+            if (ctx->user_handles[i] != 0) {
+                esp_timer_stop(ctx->user_handles[i]);
+                esp_timer_delete(ctx->user_handles[i]);
+            }
         }
     }
 
-    if (app.sys_handles != NULL) free(app.sys_handles);
-    if (app.user_handles != NULL) free(app.user_handles);
-    h2pca_release_task_pool(&(app.cfg->tasks));
+    __stop_workers(ctx);
+    __om_clear(ctx);
+#ifdef CONFIG_WC_USE_IO_STREAMS
+    __stream_done(ctx);
+#endif
+
+    if (ctx->sys_handles != NULL) __mem_free(H2PCA_MEM_APP, ctx->sys_handles);
+    if (ctx->user_handles != NULL) __mem_free(H2PCA_MEM_APP, ctx->user_handles);
+    if (ctx->sync_order != NULL) __mem_free(H2PCA_MEM_APP, ctx->sync_order);
+    ctx->sync_order = NULL;
+
+    ctx->sys_handles = NULL;
+    ctx->user_handles = NULL;
+
+    if (ctx->tasks_ctl != NULL) {
+        vSemaphoreDelete(ctx->tasks_ctl);
+        ctx->tasks_ctl = NULL;
+    }
+
+    if (ctx->cfg == NULL) return ESP_OK;
 
-    app.sys_handles = NULL;
-    app.user_handles = NULL;
+    h2pca_release_task_pool(&(ctx->cfg->tasks));
 
-    if (app.cfg->device_meta_data != NULL) free(app.cfg->device_meta_data);
+    if (ctx->cfg->device_meta_data != NULL) {
+        cJSON_Delete(ctx->cfg->device_meta_data);
+        ctx->cfg->device_meta_data = NULL;
+    }
 
     return ESP_OK;
 }
@@ -760,23 +3308,319 @@ h2pca_status * h2pca_get_status() {
     return &app;
 }
 
+esp_err_t h2pca_mem_get_stat(h2pca_mem_tag tag, h2pca_mem_stat * stat) {
+    if ((stat == NULL) || (tag >= H2PCA_MEM_TAGS_CNT)) return ESP_ERR_INVALID_ARG;
+
+#ifdef CONFIG_H2PCA_MEM_ACCOUNTING
+    portENTER_CRITICAL(&mem_lock);
+    *stat = mem_stats[tag];
+    portEXIT_CRITICAL(&mem_lock);
+
+    return ESP_OK;
+#else
+    memset(stat, 0, sizeof(h2pca_mem_stat));
+
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t h2pca_register_task_stack(const char * name, TaskHandle_t handle, uint32_t stack_size) {
+    if (handle == NULL) return ESP_ERR_INVALID_ARG;
+
+    esp_err_t res = ESP_OK;
+
+    portENTER_CRITICAL(&mem_lock);
+    int i = 0;
+    while ((i < mem_stacks_cnt) && (mem_stacks[i].handle != handle)) i++;
+    if (i < H2PCA_MAX_STACKS) {
+        mem_stacks[i].name = name;
+        mem_stacks[i].handle = handle;
+        mem_stacks[i].stack_size = stack_size;
+        if (i == mem_stacks_cnt) mem_stacks_cnt++;
+    } else
+        res = ESP_ERR_NO_MEM;
+    portEXIT_CRITICAL(&mem_lock);
+
+    return res;
+}
+
+esp_err_t h2pca_unregister_task_stack(TaskHandle_t handle) {
+    if (handle == NULL) return ESP_ERR_INVALID_ARG;
+
+    esp_err_t res = ESP_ERR_NOT_FOUND;
+
+    portENTER_CRITICAL(&mem_lock);
+    /* wait for the running scans */
+    while (mem_stacks_readers > 0) {
+        portEXIT_CRITICAL(&mem_lock);
+        vTaskDelay(1);
+        portENTER_CRITICAL(&mem_lock);
+    }
+    for (int i = 0; i < mem_stacks_cnt; ++i) {
+        if (mem_stacks[i].handle == handle) {
+            mem_stacks_cnt--;
+            memmove(&(mem_stacks[i]), &(mem_stacks[i + 1]), sizeof(h2pca_stack_reg) * (mem_stacks_cnt - i));
+            res = ESP_OK;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&mem_lock);
+
+    return res;
+}
+
+int h2pca_get_stacks_info(h2pca_stack_info * info, int max_cnt) {
+    if (info == NULL) return 0;
+
+    TaskHandle_t handles[H2PCA_MAX_STACKS];
+
+    /* the handles are copied under the lock, the stacks are scanned
+     * after it is released. the registered task is not unregistered
+     * (and deleted) till the scan is done */
+    portENTER_CRITICAL(&mem_lock);
+    int cnt = (mem_stacks_cnt < max_cnt) ? mem_stacks_cnt : max_cnt;
+    for (int i = 0; i < cnt; ++i) {
+        info[i].name = mem_stacks[i].name;
+        info[i].stack_size = mem_stacks[i].stack_size;
+        handles[i] = mem_stacks[i].handle;
+    }
+    mem_stacks_readers++;
+    portEXIT_CRITICAL(&mem_lock);
+
+    for (int i = 0; i < cnt; ++i) {
+        /* in bytes for esp-idf */
+        info[i].high_water_mark = uxTaskGetStackHighWaterMark(handles[i]);
+    }
+
+    portENTER_CRITICAL(&mem_lock);
+    mem_stacks_readers--;
+    portEXIT_CRITICAL(&mem_lock);
+
+    return cnt;
+}
+
+void h2pca_mem_log() {
+    static const char * MEM_LOG_TAG = "H2PCA_MEM";
+    static const char * MEM_TAG_NAMES[H2PCA_MEM_TAGS_CNT] = { "app", "json", "tasks", "frames" };
+
+    h2pca_mem_stat stat;
+    for (int i = 0; i < H2PCA_MEM_TAGS_CNT; ++i) {
+        if (h2pca_mem_get_stat((h2pca_mem_tag)i, &stat) == ESP_OK)
+            ESP_LOGI(MEM_LOG_TAG, "mem %s: cur=%" PRIu32 " peak=%" PRIu32 " allocs=%" PRIu32, MEM_TAG_NAMES[i],
+                                       stat.cur_bytes, stat.peak_bytes, stat.allocs);
+    }
+
+    h2pca_stack_info info[H2PCA_MAX_STACKS];
+    int cnt = h2pca_get_stacks_info(info, H2PCA_MAX_STACKS);
+    for (int i = 0; i < cnt; ++i) {
+        ESP_LOGI(MEM_LOG_TAG, "stack %s: size=%" PRIu32 " free min=%" PRIu32, info[i].name,
+                                   info[i].stack_size, info[i].high_water_mark);
+    }
+
+    ESP_LOGI(MEM_LOG_TAG, "heap: free=%" PRIu32 " min free=%" PRIu32, esp_get_free_heap_size(),
+                               esp_get_minimum_free_heap_size());
+}
+
+static h2pca_state h2pca_ctx_locked_GET_STATES(h2pca_status * ctx) {
+    return xEventGroupGetBits(ctx->client_state);
+}
+
+static bool h2pca_ctx_locked_CHK_STATE(h2pca_status * ctx, h2pca_state astate) {
+    bool val = ((h2pca_ctx_locked_GET_STATES(ctx) & astate) == astate);
+    return val;
+}
+
+static void h2pca_ctx_locked_SET_STATE(h2pca_status * ctx, h2pca_state astate) {
+    TRACE(H2PCA_TRACE_SET_STATE, 0, astate);
+    xEventGroupSetBits(ctx->client_state, astate);
+}
+
+static void h2pca_ctx_locked_CLR_STATE(h2pca_status * ctx, h2pca_state astate) {
+    TRACE(H2PCA_TRACE_CLR_STATE, 0, astate);
+    xEventGroupClearBits(ctx->client_state, astate);
+}
+
+static void h2pca_ctx_locked_CLR_ALL_STATES(h2pca_status * ctx) {
+    TRACE(H2PCA_TRACE_CLR_STATE, 0, MODE_ALL);
+    xEventGroupClearBits(ctx->client_state, MODE_ALL);
+}
+
+int h2pca_trace_snapshot(h2pca_trace_event * events, int max_cnt) {
+    if ((events == NULL) || (max_cnt <= 0)) return 0;
+
+#ifdef CONFIG_H2PCA_TRACE
+    uint32_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint32_t first = (head > CONFIG_H2PCA_TRACE_SIZE) ? (head - CONFIG_H2PCA_TRACE_SIZE) : 0;
+    int cnt = 0;
+
+    for (uint32_t seq = first; (seq != head) && (cnt < max_cnt); ++seq) {
+        h2pca_trace_event * ev = &(trace_buf[seq & (CONFIG_H2PCA_TRACE_SIZE - 1)]);
+
+        if (__atomic_load_n(&(ev->seq), __ATOMIC_ACQUIRE) != seq + 1) continue;
+        events[cnt] = *ev;
+        /* skip the event overwritten while copying */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&(ev->seq), __ATOMIC_RELAXED) != seq + 1) continue;
+        events[cnt].seq = seq + 1;
+        cnt++;
+    }
+
+    return cnt;
+#else
+    return 0;
+#endif
+}
+
+void h2pca_trace_dump() {
+#ifdef CONFIG_H2PCA_TRACE
+    static const char * HEX = "0123456789abcdef";
+    h2pca_trace_event ev;
+    char line[sizeof(h2pca_trace_event) * 2 + 1];
+
+    uint32_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint32_t first = (head > CONFIG_H2PCA_TRACE_SIZE) ? (head - CONFIG_H2PCA_TRACE_SIZE) : 0;
+
+    ESP_LOGI(TRACE_TAG, "begin %" PRIu32, head - first);
+    for (uint32_t seq = first; seq != head; ++seq) {
+        h2pca_trace_event * src = &(trace_buf[seq & (CONFIG_H2PCA_TRACE_SIZE - 1)]);
+
+        if (__atomic_load_n(&(src->seq), __ATOMIC_ACQUIRE) != seq + 1) continue;
+        ev = *src;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&(src->seq), __ATOMIC_RELAXED) != seq + 1) continue;
+        ev.seq = seq + 1;
+
+        const uint8_t * p = (const uint8_t *) &ev;
+        for (size_t i = 0; i < sizeof(h2pca_trace_event); ++i) {
+            line[i << 1] = HEX[p[i] >> 4];
+            line[(i << 1) + 1] = HEX[p[i] & 0x0f];
+        }
+        line[sizeof(h2pca_trace_event) * 2] = 0;
+
+        ESP_LOGI(TRACE_TAG, "ev %s", line);
+    }
+    ESP_LOGI(TRACE_TAG, "end");
+#endif
+}
+
+void h2pca_trace_clear() {
+#ifdef CONFIG_H2PCA_TRACE
+    for (int i = 0; i < CONFIG_H2PCA_TRACE_SIZE; ++i)
+        __atomic_store_n(&(trace_buf[i].seq), 0, __ATOMIC_RELAXED);
+#endif
+}
+
+/* default instance */
+
+h2pca_status * h2pca_init(h2pca_config * cfg, esp_err_t* error) {
+    esp_err_t err = h2pca_ctx_init(&app, cfg);
+    __set_error(error, err);
+
+    return (err == ESP_OK) ? &app : NULL;
+}
+
+void h2pca_start(uint32_t heap_sz) {
+    h2pca_ctx_start(&app, heap_sz);
+}
+
+void h2pca_loop() {
+    h2pca_ctx_loop(&app);
+}
+
+esp_err_t h2pca_done() {
+    return h2pca_ctx_done(&app);
+}
+
+esp_err_t h2pca_om_add_msg(const char * kind, const char * target, cJSON * params) {
+    return h2pca_ctx_om_add_msg(&app, kind, target, params);
+}
+
+esp_err_t h2pca_om_add_msg_ex(const char * kind, const char * target, cJSON * params, h2pca_om_policy policy) {
+    return h2pca_ctx_om_add_msg_ex(&app, kind, target, params, policy);
+}
+
+int32_t h2pca_om_count() {
+    return h2pca_ctx_om_count(&app);
+}
+
+esp_err_t h2pca_task_schedule_once(h2pca_task_id ID, uint64_t delay) {
+    return h2pca_ctx_task_schedule_once(&app, ID, delay);
+}
+
+esp_err_t h2pca_task_start_periodic(h2pca_task_id ID, uint32_t period) {
+    return h2pca_ctx_task_start_periodic(&app, ID, period);
+}
+
+esp_err_t h2pca_task_set_period(h2pca_task_id ID, uint32_t period) {
+    return h2pca_ctx_task_set_period(&app, ID, period);
+}
+
+esp_err_t h2pca_task_cancel(h2pca_task_id ID) {
+    return h2pca_ctx_task_cancel(&app, ID);
+}
+
+esp_err_t h2pca_task_pause(h2pca_task_id ID) {
+    return h2pca_ctx_task_pause(&app, ID);
+}
+
+esp_err_t h2pca_task_resume(h2pca_task_id ID) {
+    return h2pca_ctx_task_resume(&app, ID);
+}
+
+esp_err_t h2pca_task_request(h2pca_task_id ID, h2pca_task_req op, uint64_t value) {
+    return h2pca_ctx_task_request(&app, ID, op, value);
+}
+
+int32_t h2pca_task_pending_count() {
+    return h2pca_ctx_task_pending_count(&app);
+}
+
+esp_err_t h2pca_get_work_stats(h2pca_work_stats * stats) {
+    return h2pca_ctx_get_work_stats(&app, stats);
+}
+
+esp_err_t h2pca_get_sync_stats(h2pca_sync_stats * stats) {
+    return h2pca_ctx_get_sync_stats(&app, stats);
+}
+
 h2pca_state h2pca_locked_GET_STATES() {
-    return xEventGroupGetBits(app.client_state);
+    return h2pca_ctx_locked_GET_STATES(&app);
 }
 
 bool h2pca_locked_CHK_STATE(h2pca_state astate) {
-    bool val = ((h2pca_locked_GET_STATES() & astate) == astate);
-    return val;
+    return h2pca_ctx_locked_CHK_STATE(&app, astate);
 }
 
 void h2pca_locked_SET_STATE(h2pca_state astate) {
-    xEventGroupSetBits(app.client_state, astate);
+    h2pca_ctx_locked_SET_STATE(&app, astate);
 }
 
 void h2pca_locked_CLR_STATE(h2pca_state astate) {
-    xEventGroupClearBits(app.client_state, astate);
+    h2pca_ctx_locked_CLR_STATE(&app, astate);
 }
 
 void h2pca_locked_CLR_ALL_STATES() {
-    xEventGroupClearBits(app.client_state, MODE_ALL);
+    h2pca_ctx_locked_CLR_ALL_STATES(&app);
+}
+
+#ifdef CONFIG_WC_USE_IO_STREAMS
+uint8_t * h2pca_frame_acquire(size_t * capacity) {
+    return h2pca_ctx_frame_acquire(&app, capacity);
+}
+
+esp_err_t h2pca_frame_commit(uint8_t * frame, size_t len) {
+    return h2pca_ctx_frame_commit(&app, frame, len);
+}
+
+esp_err_t h2pca_frame_release(uint8_t * frame) {
+    return h2pca_ctx_frame_release(&app, frame);
+}
+
+int32_t h2pca_frames_pending() {
+    return h2pca_ctx_frames_pending(&app);
+}
+
+esp_err_t h2pca_get_stream_stats(h2pca_stream_stats * stats) {
+    return h2pca_ctx_get_stream_stats(&app, stats);
 }
+#endif
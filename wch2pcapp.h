@@ -23,6 +23,8 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <esp_event_loop.h>
 #include <nvs_flash.h>
 
@@ -42,6 +44,140 @@
 
 #define MODE_ALL             0xfffffe
 
+/* States that are not retained between deep sleep cycles */
+#define MODE_VOLATILE        (WIFI_CONNECTED_BIT | HOST_CONNECTED_BIT | \
+                              AUTHORIZED_BIT | MODE_SETIME | MODE_AUTH | \
+                              MODE_RECIEVE_MSG | MODE_SEND_MSG)
+
+/* Limits of the RTC retained state for duty-cycle mode */
+#define H2PCA_RTC_MAX_TASKS  16
+#define H2PCA_RTC_OM_SIZE    1024
+#define H2PCA_SID_SIZE       64
+
+/* Size of the incoming msgs de-duplication cache (power of two) */
+#define H2PCA_DEDUP_RING_SIZE   64
+#define H2PCA_DEDUP_FILTER_SIZE 256
+
+/* Memory accounting tags */
+typedef enum {
+    /* application layer allocations */
+    H2PCA_MEM_APP = 0,
+    /* cJSON objects. The cJSON hooks are process-wide: the objects of
+     * all components that use cJSON are counted, not only the ones of
+     * the application */
+    H2PCA_MEM_JSON,
+    /* task pool */
+    H2PCA_MEM_TASKS,
+    /* media frames ring */
+    H2PCA_MEM_FRAMES,
+    H2PCA_MEM_TAGS_CNT
+} h2pca_mem_tag;
+
+typedef struct h2pca_mem_stat_t
+{
+    /* currently allocated bytes */
+    uint32_t cur_bytes;
+    /* peak value of allocated bytes */
+    uint32_t peak_bytes;
+    /* total count of allocations */
+    uint32_t allocs;
+} h2pca_mem_stat;
+
+/* Max count of tasks with accounted stacks */
+#define H2PCA_MAX_STACKS     8
+
+typedef struct h2pca_stack_info_t
+{
+    const char * name;
+    /* stack size (0 if unknown) */
+    uint32_t stack_size;
+    /* min amount of free stack space since the task started */
+    uint32_t high_water_mark;
+} h2pca_stack_info;
+
+/* Trace events. Keep in sync with tools/h2pca_trace2json.py */
+typedef enum {
+    /* id - 0, arg - bitmask */
+    H2PCA_TRACE_SET_STATE = 1,
+    H2PCA_TRACE_CLR_STATE,
+    /* id - system timer (H2PCA_TRACE_SYS_*) */
+    H2PCA_TRACE_SYS_TIMER,
+    /* id - ID of the user task */
+    H2PCA_TRACE_USER_TIMER,
+    /* id - phase (H2PCA_TRACE_PH_*) */
+    H2PCA_TRACE_PHASE_BEGIN,
+    H2PCA_TRACE_PHASE_END,
+    /* id - request (H2PCA_TRACE_REQ_*), arg - result of request */
+    H2PCA_TRACE_REQ_BEGIN,
+    H2PCA_TRACE_REQ_END,
+    /* id - 1 if the high watermark reached, 0 if the low one, arg - msgs count */
+    H2PCA_TRACE_OM_PRESSURE,
+    /* id - recovery tier (h2pca_recovery), arg - error code */
+    H2PCA_TRACE_RECOVERY
+} h2pca_trace_type;
+
+/* system timers */
+#define H2PCA_TRACE_SYS_SEND    0
+#define H2PCA_TRACE_SYS_RECV    1
+#define H2PCA_TRACE_SYS_TELEMETRY 2
+
+/* main loop phases */
+#define H2PCA_TRACE_PH_STEP     0
+#define H2PCA_TRACE_PH_AUTH     1
+#define H2PCA_TRACE_PH_RECV     2
+#define H2PCA_TRACE_PH_INMSGS   3
+#define H2PCA_TRACE_PH_SEND     4
+#define H2PCA_TRACE_PH_CONNECT  5
+#define H2PCA_TRACE_PH_SYNC     6
+#define H2PCA_TRACE_PH_STREAM   7
+#define H2PCA_PHASES_CNT        8
+
+/* h2pc requests */
+#define H2PCA_TRACE_REQ_CONNECT    0
+#define H2PCA_TRACE_REQ_AUTHORIZE  1
+#define H2PCA_TRACE_REQ_GET_MSGS   2
+#define H2PCA_TRACE_REQ_SEND_MSGS  3
+#define H2PCA_TRACE_REQ_KEEPALIVE  4
+
+typedef struct h2pca_trace_event_t
+{
+    /* sequence number + 1 (0 - the event is not written yet) */
+    uint32_t seq;
+    /* timestamp (lower 32 bits of esp_timer_get_time, in us) */
+    uint32_t ts;
+    uint16_t type;
+    uint16_t id;
+    uint32_t arg;
+} h2pca_trace_event;
+
+/* Main loop phase timings (in us) */
+typedef struct h2pca_phase_stat_t
+{
+    uint32_t cnt;
+    uint32_t max;
+    uint64_t sum;
+} h2pca_phase_stat;
+
+/* Kind of the telemetry message */
+#define H2PCA_TELEMETRY_KIND "h2pca_stat"
+
+/* Values of the last sent telemetry report (the last sent value of
+ * each gauge). The next report contains only the changes */
+typedef struct h2pca_telemetry_base_t
+{
+    uint32_t overruns;
+    uint32_t wifi_fails;
+    uint32_t connect_fails;
+    uint32_t dead_conns;
+    uint32_t om_lost;
+    uint32_t deadline_misses;
+    uint32_t sync_aged;
+    uint32_t sync_carry_caps;
+    uint32_t heap_kb;
+    uint32_t heap_min_kb;
+    int8_t rssi;
+} h2pca_telemetry_base;
+
 /* Application configuration layer */
 
 typedef void (* h2pca_on_notify) ();
@@ -71,6 +207,101 @@ typedef void (* h2pca_sync_task_cb) (h2pca_task_id id,
                                      void * user_data,
                                      uint32_t * restart_period);
 
+/* Start mode of the task */
+typedef enum {
+    /* the task is started with the application and fired every period */
+    H2PCA_TASK_PERIODIC = 0,
+    /* the task is started with the application and fired once after period */
+    H2PCA_TASK_ONESHOT,
+    /* the task is not started till the h2pca_task_schedule_once or
+     * h2pca_task_start_periodic call */
+    H2PCA_TASK_DEFERRED
+} h2pca_task_mode;
+
+/* Execution context of the on_time callback */
+typedef enum {
+    /* on_time is called directly in the esp_timer task */
+    H2PCA_EXEC_TIMER = 0,
+    /* on_time is called in the application work-queue task */
+    H2PCA_EXEC_WORKER
+} h2pca_task_exec;
+
+/* Deferred control request of the task (see h2pca_task_request) */
+typedef enum {
+    H2PCA_TASK_REQ_NONE = 0,
+    /* h2pca_task_schedule_once, value - delay */
+    H2PCA_TASK_REQ_SCHEDULE_ONCE,
+    /* h2pca_task_start_periodic, value - period or 0 */
+    H2PCA_TASK_REQ_START_PERIODIC,
+    /* h2pca_task_set_period, value - period */
+    H2PCA_TASK_REQ_SET_PERIOD,
+    /* h2pca_task_cancel */
+    H2PCA_TASK_REQ_CANCEL,
+    /* h2pca_task_pause */
+    H2PCA_TASK_REQ_PAUSE,
+    /* h2pca_task_resume */
+    H2PCA_TASK_REQ_RESUME,
+    H2PCA_TASK_REQ_CNT
+} h2pca_task_req;
+
+/* Work queue overflow policy */
+typedef enum {
+    /* drop the new event */
+    H2PCA_OVERFLOW_DROP = 0,
+    /* skip the event if the task is already in queue, otherwise drop */
+    H2PCA_OVERFLOW_COALESCE,
+    /* block the esp_timer task till the queue has free space */
+    H2PCA_OVERFLOW_BLOCK
+} h2pca_overflow_policy;
+
+/* Outgoing msg policy when the queue reaches the high watermark */
+typedef enum {
+    /* evict the oldest waiting msgs to keep the new one */
+    H2PCA_OM_KEEP = 0,
+    /* drop the new msg */
+    H2PCA_OM_SHED,
+    /* replace the waiting msg with the same kind and target in place
+     * (at any queue level), otherwise shed */
+    H2PCA_OM_COALESCE
+} h2pca_om_policy;
+
+/* Recovery tier for h2pc protocol errors */
+typedef enum {
+    /* keep going */
+    H2PCA_RECOVER_IGNORE = 0,
+    /* repeat the failed request after backoff */
+    H2PCA_RECOVER_RETRY,
+    /* drop the session and authorize again */
+    H2PCA_RECOVER_REAUTH,
+    /* disconnect and connect to the host again */
+    H2PCA_RECOVER_RECONNECT,
+    /* restart the chip */
+    H2PCA_RECOVER_REBOOT,
+    H2PCA_RECOVER_TIERS_CNT
+} h2pca_recovery;
+
+/* Count of the steps retried separately (MODE_AUTH, MODE_RECIEVE_MSG,
+ * MODE_SEND_MSG) */
+#define H2PCA_RETRY_STEPS_CNT   3
+
+/* Rule of the error classification table */
+typedef struct h2pca_error_rule_t
+{
+    /* value of h2pc_get_last_error */
+    int error;
+    h2pca_recovery tier;
+} h2pca_error_rule;
+
+/* Runtime flags of the task */
+/* the task timer is running or paused */
+#define H2PCA_TASK_ARMED     BIT0
+/* the task timer is paused */
+#define H2PCA_TASK_PAUSED    BIT1
+/* the task is fired once */
+#define H2PCA_TASK_ONCE      BIT2
+/* the task is waiting in the work queue */
+#define H2PCA_TASK_QUEUED    BIT3
+
 typedef struct h2pca_task_t
 {
     /* TAG name of the task for logging */
@@ -106,15 +337,162 @@ typedef struct h2pca_task_t
     /* user data, associated with task */
     void * user_data;
 
+    /* Start mode of the task */
+    h2pca_task_mode mode;
+
+    /* Execution context of on_time callback */
+    h2pca_task_exec exec;
+
+    /* Order of on_sync callbacks. Pending sync events are dispatched
+     * earliest deadline first, then by higher priority. The event without
+     * deadline gets one after several steps of waiting */
+    uint8_t priority;
+    /* max time between the sync event and on_sync call (in us, 0 - none) */
+    uint32_t sync_deadline;
+    /* count of on_sync calls after the deadline */
+    uint32_t deadline_misses;
+
+    /* Runtime state. Managed internaly */
+    /* the application status the task is started with */
+    struct h2pca_status_t * owner;
+    volatile uint32_t flags;
+    /* the expected time of the next fire (in us). remaining time if paused */
+    int64_t deadline;
+    /* the time the sync event became pending (in us, 0 - not pending) */
+    int64_t sync_ready_at;
+    /* the control request waiting for the main task and its value */
+    h2pca_task_req req_op;
+    uint64_t req_value;
+
 } h2pca_task;
 
 
+/* Constant task definition. Use H2PCA_TASK_TABLE to declare the
+ * task set at compile time. The definitions are initializers only:
+ * every field is copied into one static block of tasks on bind.
+ * The table saves the heap allocations of tasks and the pointer array,
+ * but it does not move the constant fields to flash: each task takes
+ * the full h2pca_task in RAM, and the const table adds its flash copy */
+typedef struct h2pca_task_def_t
+{
+    const char * TAG;
+    h2pca_task_id ID;
+    uint32_t period;
+    h2pca_state req_bitmask;
+    h2pca_state apply_bitmask;
+    h2pca_task_cb on_time;
+    h2pca_sync_task_cb on_sync;
+    void * user_data;
+    h2pca_task_mode mode;
+    h2pca_task_exec exec;
+    uint8_t priority;
+    uint32_t sync_deadline;
+} h2pca_task_def;
+
+/* Periodic task fired in the esp_timer task, without sync priority
+ * and deadline */
+#define H2PCA_TASK_DEF(tag, id, per, req, apply, ontime, onsync, data) \
+    H2PCA_TASK_DEF_EX(tag, id, per, req, apply, ontime, onsync, data, \
+                      H2PCA_TASK_PERIODIC, H2PCA_EXEC_TIMER, 0, 0)
+
+/* Task with the given start mode, on_time context, on_sync priority
+ * and sync deadline (in us, 0 - none) */
+#define H2PCA_TASK_DEF_EX(tag, id, per, req, apply, ontime, onsync, data, md, ex, prio, deadline) \
+    { .TAG = (tag), .ID = (id), .period = (per), .req_bitmask = (req), \
+      .apply_bitmask = (apply), .on_time = (ontime), .on_sync = (onsync), \
+      .user_data = (data), .mode = (md), .exec = (ex), .priority = (prio), \
+      .sync_deadline = (deadline) }
+
+/* Declare the static task table
+ *   H2PCA_TASK_TABLE(sensors,
+ *       H2PCA_TASK_DEF("temp", TSK_TEMP, 1000000, AUTHORIZED_BIT, BIT8, NULL, on_temp, NULL),
+ *       H2PCA_TASK_DEF_EX("hum", TSK_HUM, 5000000, AUTHORIZED_BIT, BIT9, on_hum_read, on_hum, NULL,
+ *                         H2PCA_TASK_PERIODIC, H2PCA_EXEC_WORKER, 1, 500000));
+ * Access is O(1) by index. Lookup by ID is O(1) if IDs are equal to
+ * indexes in the table or less than H2PCA_TASK_ID_MAP_MAX
+ */
+#define H2PCA_TASK_TABLE(name, ...) \
+    static const h2pca_task_def name##_defs[] = { __VA_ARGS__ }; \
+    static h2pca_task name##_rt[sizeof(name##_defs) / sizeof(h2pca_task_def)]
+
+/* Bind the static task table declared with H2PCA_TASK_TABLE to the pool */
+#define H2PCA_TASK_TABLE_BIND(pool, name) \
+    h2pca_task_pool_bind_table((pool), name##_defs, name##_rt, \
+                               sizeof(name##_defs) / sizeof(h2pca_task_def))
+
+/* Max task ID value to lookup through the ID map */
+#define H2PCA_TASK_ID_MAP_MAX 256
+
 typedef struct h2pca_tasks_t
 {
     int32_t cnt;
     h2pca_task ** tasks;
+
+    /* allocated length of tasks array */
+    int32_t capacity;
+    /* runtime block of the static task table. if not NULL
+     * tasks are stored here instead of tasks array */
+    h2pca_task * block;
+    /* task index + 1 by ID (0 - no task) */
+    uint8_t * id_map;
+    uint32_t id_map_sz;
 } h2pca_tasks;
 
+/* Work queue and timers statistics (in us) */
+typedef struct h2pca_work_stats_t
+{
+    uint32_t queued;
+    uint32_t dropped;
+    uint32_t coalesced;
+    uint32_t executed;
+    /* time between enqueue and execution */
+    int64_t latency_max;
+    int64_t latency_sum;
+    /* time between the expected and actual fire of user timers */
+    int64_t lateness_max;
+    int64_t lateness_sum;
+    uint32_t lateness_cnt;
+} h2pca_work_stats;
+
+typedef struct h2pca_sync_stats_t
+{
+    /* on_sync calls after the sync deadline (sum over all tasks) */
+    uint32_t deadline_misses;
+    /* on_sync calls of tasks without deadline moved up by aging */
+    uint32_t aged;
+    /* steps the carried over events were delayed by the loop period
+     * after the max count of steps without delay */
+    uint32_t carry_caps;
+} h2pca_sync_stats;
+
+#ifdef CONFIG_WC_USE_IO_STREAMS
+/* Upload the frame to the host. The frame data points directly into the
+ * frames ring and stays valid till the callback returns
+ * @param data [input] frame data
+ * @param len  [input] length of the frame
+ * @param seq  [input] sequence number of the frame
+ * @return ESP_OK if the frame is uploaded. On error the frame is kept
+ *         in the ring and the upload is retried in the next step
+ */
+typedef esp_err_t (* h2pca_on_send_frame) (const uint8_t * data, size_t len, uint32_t seq);
+
+/* Media streaming statistics */
+typedef struct h2pca_stream_stats_t
+{
+    uint32_t committed;
+    uint32_t sent;
+    /* frames dropped by producers under backpressure */
+    uint32_t dropped;
+    uint32_t send_errors;
+    uint64_t bytes_sent;
+    /* uploaded frames per second (over the last second) */
+    float fps;
+    /* time between commit and the end of upload (in us) */
+    int64_t latency_max;
+    int64_t latency_sum;
+} h2pca_stream_stats;
+#endif
+
 typedef struct h2pca_ble_config_t
 {
     int count;
@@ -139,16 +517,125 @@ typedef struct h2pca_config_t {
     h2pca_tasks tasks;
 
     uint32_t main_loop_period;
+    /* max time of on_sync callbacks in one step of the main loop
+     * (in us, 0 - not limited). at least one callback is called per step,
+     * the rest are carried over to the next step */
+    uint32_t sync_step_budget;
     uint32_t send_msgs_period;
     uint32_t recv_msgs_period;
 
     int32_t inmsgs_proceed_chunk;
 
+    /* Skip incoming msgs that were already handled (by msg_id and src).
+     * Only string and number ids are checked, msgs with other ids pass.
+     * The cache of recent msgs is kept between reconnects and deep sleeps */
+    bool inmsgs_dedup;
+
+    /* Duty-cycle mode. If set, the main loop runs only one cycle
+     * (connect, authorize, drain incoming msgs, send outgoing msgs,
+     * run due on_sync callbacks) and puts the chip into deep sleep
+     * till the next task deadline. The session is not resumed: the
+     * device authorizes again on every wakeup. Only msgs added with
+     * h2pca_om_add_msg* are retained in RTC memory, msgs added directly
+     * with h2pc_om_add_msg and not sent are lost in sleep */
+    bool duty_cycle;
+    /* max time to stay awake in duty-cycle mode (in us) */
+    uint32_t duty_cycle_max_awake;
+    /* min time to sleep in duty-cycle mode (in us) */
+    uint32_t duty_cycle_min_sleep;
+
+    /* Work queue for tasks with H2PCA_EXEC_WORKER */
+    /* count of worker tasks */
+    uint8_t workers_cnt;
+    uint8_t workers_priority;
+    uint32_t workers_stack_size;
+    /* max count of waiting events */
+    uint32_t workers_queue_depth;
+    h2pca_overflow_policy workers_overflow;
+
+#ifdef CONFIG_WC_USE_IO_STREAMS
+    /* Media streaming. The frames ring is allocated in h2pca_init
+     * (0 - streaming is disabled) */
+    uint8_t stream_frames_cnt;
+    /* max size of one frame */
+    uint32_t stream_frame_size;
+    /* place the ring in PSRAM if available */
+    bool stream_use_psram;
+    /* max count of frames uploaded in one step of the main loop */
+    uint8_t stream_frames_per_step;
+    h2pca_on_send_frame     on_send_frame;
+#endif
+
+    /* Error classification table. If NULL - the standard table is used:
+     * no session - re-authorize, internal or database server errors -
+     * retry, the others - error_default_tier */
+    const h2pca_error_rule * error_rules;
+    int32_t error_rules_cnt;
+    h2pca_recovery error_default_tier;
+    /* first retry delay (in us). doubled on each next retry */
+    uint32_t error_retry_backoff;
+    /* max count of retries in a row. the next error leads to reconnect */
+    uint8_t error_retry_max;
+
+    /* Send pacing. Msgs are passed to the h2pc client in batches limited
+     * by token buckets: rate - refill per second, burst - capacity
+     * (rate 0 - not limited, by default). The next batch is passed only
+     * after the previous one is sent. The rate is halved when the host
+     * answers with an error of H2PCA_RECOVER_RETRY tier and restored
+     * step by step on success.
+     * Only msgs added with h2pca_om_add_msg* are paced. Msgs added
+     * directly with h2pc_om_add_msg bypass the buckets and are sent
+     * with the next request */
+    uint32_t send_rate_msgs;
+    uint32_t send_burst_msgs;
+    uint32_t send_rate_bytes;
+    uint32_t send_burst_bytes;
+
+    /* Telemetry. If set, the summary of the application performance is
+     * sent to the host every telemetry_period (in us) as the message of
+     * H2PCA_TELEMETRY_KIND kind. The report waits for the outgoing queue
+     * to fall to the low watermarks for a few periods, then it is sent
+     * anyway. It is shed under backpressure (0 - disabled) */
+    uint32_t telemetry_period;
+
+    /* Keepalive. If no request succeeded for keepalive_period (in us),
+     * the connection is probed (0 - disabled). Only transport failures
+     * and timeouts are counted, a protocol error is classified by the
+     * error rules. After keepalive_max_fails failed probes in a row the
+     * connection is closed */
+    uint32_t keepalive_period;
+    uint8_t keepalive_max_fails;
+
+    /* Outgoing queue watermarks. The queue never grows above the high
+     * watermark (0 - not limited). on_om_high is fired once the queue
+     * reaches the high watermark, on_om_low - once it falls to the low
+     * one (0 - half of the high watermark). The batch passed to the h2pc
+     * client is counted till it is sent. Msgs added directly with
+     * h2pc_om_add_msg are not counted and not bounded */
+    int32_t om_high_msgs;
+    int32_t om_low_msgs;
+    uint32_t om_high_bytes;
+    uint32_t om_low_bytes;
+
+    /* Wi-Fi fast reconnect. If set, the last successful BSSID and channel
+     * are cached in RTC memory and used for a directed connect.
+     * On failure the full scan is used */
+    bool wifi_fast_connect;
+    /* Use the cached IP lease as the static IP and skip DHCP while the
+     * lease is not expired. DHCP is used if the address can not be set
+     * (only with wifi_fast_connect) */
+    bool wifi_static_ip;
+
     /* wifi callbacks */
     h2pca_on_notify         on_wifi_init;
     h2pca_on_notify         on_wifi_con;
     h2pca_on_notify         on_wifi_dis;
 
+    /* outgoing queue callbacks. called in the producer's task
+     * or in the main task */
+    h2pca_on_notify         on_om_high;
+    h2pca_on_notify         on_om_low;
+
     /* wc protocol callbacks */
     h2pca_on_notify         on_connect;
     h2pca_onauthorized      on_auth;
@@ -187,8 +674,145 @@ typedef struct h2pca_status_t
     int wifi_connect_errors;
     int connect_errors;
 
+    /* Wi-Fi connection timings */
+    /* the time of the last connection attempt (in us) */
+    int64_t wifi_connect_start;
+    /* the last time-to-IP value (in us) */
+    int64_t wifi_time_to_ip;
+    /* the directed connect with the cached params is in progress */
+    bool wifi_fast_attempt;
+    /* hash of the current Wi-Fi config */
+    uint32_t wifi_cfg_hash;
+
     esp_timer_handle_t * sys_handles;
     esp_timer_handle_t * user_handles;
+    /* indexes of tasks with pending sync events in dispatch order */
+    int32_t * sync_order;
+    /* lock for runtime state of user tasks */
+    portMUX_TYPE tasks_lock;
+    /* serializes the task control calls */
+    SemaphoreHandle_t tasks_ctl;
+    /* some tasks have control requests waiting for the main task */
+    volatile bool tasks_req_pending;
+
+    /* work queue for on_time callbacks */
+    QueueHandle_t work_queue;
+    TaskHandle_t * workers;
+    h2pca_work_stats work_stats;
+
+    /* stack size of the main task (0 if the task is created by user) */
+    uint32_t main_stack_size;
+
+    /* Outgoing msgs waiting to be passed to the h2pc client */
+    struct h2pca_om_item_t * om_first;
+    struct h2pca_om_item_t * om_last;
+    int32_t om_cnt;
+    uint32_t om_bytes;
+    /* msgs passed to the h2pc client and not sent yet. they are counted
+     * by the watermarks too */
+    int32_t om_h2pc_cnt;
+    uint32_t om_h2pc_bytes;
+    portMUX_TYPE om_lock;
+    /* the queue reached the high watermark and not fell to the low one */
+    bool om_pressure;
+    /* msgs dropped by H2PCA_OM_SHED policy or as bigger than
+     * om_high_bytes, replaced by H2PCA_OM_COALESCE and evicted by
+     * H2PCA_OM_KEEP policies */
+    uint32_t om_shed;
+    uint32_t om_coalesced;
+    uint32_t om_evicted;
+
+#ifdef CONFIG_WC_USE_IO_STREAMS
+    /* Ring of media frames */
+    struct h2pca_frame_ring_t * frames;
+    h2pca_stream_stats stream_stats;
+#endif
+
+    /* Error recovery state */
+    /* steps (MODE_* bits) waiting for retry */
+    h2pca_state retry_mode;
+    /* per retried step (auth, recv, send). the time of the next retry
+     * (in us) and count of retries in a row */
+    int64_t retry_at[H2PCA_RETRY_STEPS_CNT];
+    uint8_t retries[H2PCA_RETRY_STEPS_CNT];
+    /* count of applied recoveries per tier */
+    uint32_t recoveries[H2PCA_RECOVER_TIERS_CNT];
+
+    /* Send pacing state */
+    /* tokens (in units * 1000000) */
+    int64_t send_tokens_msgs;
+    int64_t send_tokens_bytes;
+    int64_t send_refill_at;
+    /* current share of the configured rate (256 - full rate) */
+    uint16_t send_rate_scale;
+    /* batch sizes */
+    uint32_t batches;
+    uint32_t batch_last_msgs;
+    uint32_t batch_last_bytes;
+    uint32_t batch_max_msgs;
+    uint32_t batch_max_bytes;
+    /* backlog drain after reconnect. the start time (0 - no backlog),
+     * the length of backlog, the batches count at the start, the time
+     * (in us) and the count of batches of the last drain */
+    int64_t drain_start;
+    int32_t drain_msgs;
+    uint32_t drain_batches_at;
+    int64_t drain_time;
+    uint32_t drain_batches;
+
+    /* Performance counters */
+    int64_t phase_start[H2PCA_PHASES_CNT];
+    /* phase timings since the last telemetry report */
+    h2pca_phase_stat phase_stats[H2PCA_PHASES_CNT];
+    /* count of steps longer than main_loop_period */
+    uint32_t loop_overruns;
+    /* total count of failed connections */
+    uint32_t wifi_fails;
+    uint32_t connect_fails;
+    /* max length of the outgoing queue since the last telemetry report */
+    int32_t om_peak;
+    /* sync events dispatched by the aging deadline and the carry limit hits */
+    uint32_t sync_aged;
+    uint32_t sync_carry_caps;
+
+    /* Telemetry state */
+    volatile bool telemetry_due;
+    /* periods passed while the report was waiting for the queue */
+    volatile uint8_t telemetry_skipped;
+    uint32_t telemetry_seq;
+    h2pca_telemetry_base telemetry_base;
+
+    /* Connection liveness */
+    /* the time of the last successful request (in us) */
+    int64_t last_alive;
+    /* the time of the last keepalive probe (in us) */
+    int64_t keepalive_last;
+    /* failed probes in a row and the start of the first one (in us) */
+    uint8_t keepalive_fails;
+    int64_t keepalive_first_fail;
+    uint32_t keepalive_probes;
+    /* round-trip time of the last successful probe and the max one (in us) */
+    int64_t keepalive_rtt;
+    int64_t keepalive_rtt_max;
+    /* count of connections closed as dead */
+    uint32_t dead_conns;
+    /* time between the start of the first failed probe and the close
+     * of the last dead connection (in us) */
+    int64_t dead_detect_time;
+
+    /* Incoming msgs de-duplication counters */
+    uint32_t dedup_hits;
+    uint32_t dedup_misses;
+
+    /* Duty-cycle state */
+    /* the app is started after the deep sleep */
+    bool woken_from_sleep;
+    /* the count of wakeups since power on */
+    uint32_t wakeups;
+    /* the last wake-to-sleep time (in us) */
+    int64_t awake_time;
+    /* the session id of the last authorization */
+    char session[H2PCA_SID_SIZE];
 } h2pca_status;
 
 
@@ -229,6 +853,35 @@ h2pca_tasks * h2pca_new_task_pool(esp_err_t * error);
  */
 esp_err_t h2pca_task_pool_add_task(h2pca_tasks * pool, h2pca_task * tsk);
 
+/* Bind the static task table to the empty task pool. Runtime
+ * state of tasks is initialized from the definitions
+ * @param pool [input] initilized empty task pool
+ * @param defs [input] constant task definitions
+ * @param block [input] runtime storage for \a cnt tasks
+ * @param cnt  [input] count of tasks
+ * @return the last error code
+ *         ESP_ERR_INVALID_ARG - param(s) is NULL or malformed
+ *         ESP_ERR_INVALID_STATE - the pool is not empty
+ *         ESP_ERR_NO_MEM - not enought memory avaible
+ */
+esp_err_t h2pca_task_pool_bind_table(h2pca_tasks * pool, const h2pca_task_def * defs,
+                                     h2pca_task * block, int32_t cnt);
+
+/* Get the task by index in the task pool
+ * @return the task or NULL if the index is out of range
+ */
+h2pca_task * h2pca_task_pool_get_at(h2pca_tasks * pool, int32_t idx);
+
+/* Find the task in the task pool by ID
+ * @return the index of the task or -1 if not found
+ */
+int32_t h2pca_task_pool_index_of(h2pca_tasks * pool, h2pca_task_id ID);
+
+/* Find the task in the task pool by ID
+ * @return the task or NULL if not found
+ */
+h2pca_task * h2pca_task_pool_find(h2pca_tasks * pool, h2pca_task_id ID);
+
 /* Destroy all tasks in the task pool. To destroy the task pool, additionally
  * use free route. If the task pool attached to the current app -
  * no need to release it - this task pool will be removed in
@@ -239,6 +892,161 @@ esp_err_t h2pca_task_pool_add_task(h2pca_tasks * pool, h2pca_task * tsk);
  */
 esp_err_t h2pca_release_task_pool(h2pca_tasks * tsks);
 
+/* Application task control layer.
+ * These routes can be called from any task or timer callback (not from
+ * ISR) after the application is started. Concurrent calls are serialized
+ * by a mutex. Periods and delays are in us. In duty-cycle mode only
+ * h2pca_task_set_period is supported. Use h2pca_task_request from ISR
+ * or where the call must not block */
+
+/* Fire the task once after the delay. If the task is already scheduled,
+ * it is rescheduled (useful to debounce events)
+ * @param ID    [input] ID of the task
+ * @param delay [input] delay before the task fires
+ * @return the last error code
+ *         ESP_ERR_NOT_FOUND - no task with such ID
+ *         ESP_ERR_INVALID_STATE - task timers are not started
+ */
+esp_err_t h2pca_task_schedule_once(h2pca_task_id ID, uint64_t delay);
+
+/* Start or restart the task as periodic
+ * @param ID     [input] ID of the task
+ * @param period [input] new period of the task or 0 to keep the current one
+ * @return the last error code
+ */
+esp_err_t h2pca_task_start_periodic(h2pca_task_id ID, uint32_t period);
+
+/* Change the period of the task. The running periodic task is restarted
+ * with the new period
+ * @return the last error code
+ */
+esp_err_t h2pca_task_set_period(h2pca_task_id ID, uint32_t period);
+
+/* Stop the task
+ * @return the last error code
+ */
+esp_err_t h2pca_task_cancel(h2pca_task_id ID);
+
+/* Pause the running task. The remaining time of one-shot task is kept
+ * @return the last error code
+ */
+esp_err_t h2pca_task_pause(h2pca_task_id ID);
+
+/* Resume the paused task
+ * @return the last error code
+ */
+esp_err_t h2pca_task_resume(h2pca_task_id ID);
+
+/* Request the control operation to be done by the main task in its next
+ * step. Never blocks, so it can be called from ISR and from the
+ * callbacks that can not wait for the control mutex. The later request
+ * of the task replaces the not applied one. Errors of the operation
+ * are logged when it is applied
+ * @param ID    [input] ID of the task
+ * @param op    [input] the operation
+ * @param value [input] delay or period of the operation (in us)
+ * @return the last error code
+ *         ESP_ERR_INVALID_ARG - \a op param is malformed
+ *         ESP_ERR_INVALID_STATE - the application is not initialized
+ *         ESP_ERR_NOT_FOUND - no task with such ID
+ */
+esp_err_t h2pca_task_request(h2pca_task_id ID, h2pca_task_req op, uint64_t value);
+
+/* Get the count of running (not paused) tasks
+ * @return the count of tasks
+ */
+int32_t h2pca_task_pending_count();
+
+/* Get statistics of the work queue and user timers
+ * @param stats [output] current statistics
+ * @return the last error code
+ *         ESP_ERR_INVALID_ARG - \a stats param is NULL
+ */
+esp_err_t h2pca_get_work_stats(h2pca_work_stats * stats);
+
+/* Get statistics of the sync events dispatch. The deadline misses of
+ * one task are in its deadline_misses field
+ * @param stats [output] current statistics
+ * @return the last error code
+ *         ESP_ERR_INVALID_ARG - \a stats param is NULL
+ */
+esp_err_t h2pca_get_sync_stats(h2pca_sync_stats * stats);
+
+/* Application outgoing messages layer */
+
+/* Add new message to the outgoing queue. The message will be passed to the
+ * h2pc client in the next send step. In duty-cycle mode not sent messages are
+ * retained in RTC memory till the next wakeup
+ * @param kind   [input] kind of the message
+ * @param target [input] target device name or NULL
+ * @param params [input] params of the message or NULL. The params object
+ *                 is released inside the route
+ * @return the last error code
+ *         ESP_ERR_INVALID_ARG - \a kind param is NULL
+ *         ESP_ERR_INVALID_SIZE - the message is bigger than om_high_bytes
+ *         ESP_ERR_NO_MEM - not enought memory avaible
+ */
+esp_err_t h2pca_om_add_msg(const char * kind, const char * target, cJSON * params);
+
+/* Add new message to the outgoing queue with the given backpressure policy
+ * @param kind   [input] kind of the message
+ * @param target [input] target device name or NULL
+ * @param params [input] params of the message or NULL. The params object
+ *                 is released inside the route
+ * @param policy [input] what to do if the queue is full
+ * @return the last error code
+ *         ESP_ERR_INVALID_ARG - \a kind param is NULL
+ *         ESP_ERR_INVALID_SIZE - the message is bigger than om_high_bytes
+ *         ESP_ERR_NO_MEM - not enought memory avaible
+ *         ESP_FAIL - the queue is full and the message is shed
+ */
+esp_err_t h2pca_om_add_msg_ex(const char * kind, const char * target, cJSON * params, h2pca_om_policy policy);
+
+/* Get the count of messages in the outgoing queue
+ * @return the count of messages
+ */
+int32_t h2pca_om_count();
+
+#ifdef CONFIG_WC_USE_IO_STREAMS
+/* Application media streaming layer.
+ * The producer acquires a free frame, fills it in place and commits it.
+ * Committed frames are uploaded in the main loop after outgoing msgs are
+ * sent. If there is no free frame the oldest not uploaded one is dropped */
+
+/* Acquire a frame to fill. Can be called from any task
+ * @param capacity [output] if not null - here stored the max size of frame
+ * @return pointer to the frame data or NULL if the streaming is disabled
+ *         or all frames are being filled or uploaded
+ */
+uint8_t * h2pca_frame_acquire(size_t * capacity);
+
+/* Pass the filled frame to the uploader
+ * @param frame [input] pointer returned by h2pca_frame_acquire
+ * @param len   [input] length of the frame data
+ * @return the last error code
+ *         ESP_ERR_INVALID_ARG - \a frame is not acquired or \a len is too big
+ */
+esp_err_t h2pca_frame_commit(uint8_t * frame, size_t len);
+
+/* Return the acquired frame to the ring without upload
+ * @return the last error code
+ *         ESP_ERR_INVALID_ARG - \a frame is not acquired
+ */
+esp_err_t h2pca_frame_release(uint8_t * frame);
+
+/* Get the count of frames waiting to be uploaded
+ * @return the count of frames
+ */
+int32_t h2pca_frames_pending();
+
+/* Get media streaming statistics
+ * @param stats [output] current statistics
+ * @return the last error code
+ *         ESP_ERR_INVALID_ARG - \a stats param is NULL
+ */
+esp_err_t h2pca_get_stream_stats(h2pca_stream_stats * stats);
+#endif
+
 /* Application lifecircle layer */
 
 /* Init fields in configuration structure with
@@ -276,6 +1084,65 @@ esp_err_t h2pca_done();
  */
 h2pca_status * h2pca_get_status();
 
+/* Memory accounting layer */
+
+/* Get heap usage for the given tag. Requires CONFIG_H2PCA_MEM_ACCOUNTING
+ * @param tag  [input] accounting tag
+ * @param stat [output] heap usage
+ * @return the last error code
+ *         ESP_ERR_INVALID_ARG - param(s) is NULL or malformed
+ *         ESP_ERR_NOT_SUPPORTED - memory accounting is disabled
+ */
+esp_err_t h2pca_mem_get_stat(h2pca_mem_tag tag, h2pca_mem_stat * stat);
+
+/* Register the task created by user to account its stack. The main task
+ * and tasks created by the application are registered internaly.
+ * The task must be unregistered before it is deleted
+ * @param name  [input] name of the task
+ * @param handle [input] handle of the task
+ * @param stack_size [input] stack size of the task or 0 if unknown
+ * @return the last error code
+ *         ESP_ERR_INVALID_ARG - \a handle param is NULL
+ *         ESP_ERR_NO_MEM - too many tasks registered
+ */
+esp_err_t h2pca_register_task_stack(const char * name, TaskHandle_t handle, uint32_t stack_size);
+
+/* Unregister the task before it is deleted. Waits for the running
+ * h2pca_get_stacks_info calls. Not for ISR
+ * @param handle [input] handle of the task
+ * @return the last error code
+ *         ESP_ERR_INVALID_ARG - \a handle param is NULL
+ *         ESP_ERR_NOT_FOUND - the task is not registered
+ */
+esp_err_t h2pca_unregister_task_stack(TaskHandle_t handle);
+
+/* Get stack high-water marks for registered tasks
+ * @param info    [output] array to store info
+ * @param max_cnt [input] the length of \a info array
+ * @return the count of stored values
+ */
+int h2pca_get_stacks_info(h2pca_stack_info * info, int max_cnt);
+
+/* Write memory usage report to the log */
+void h2pca_mem_log();
+
+/* Trace layer. Requires CONFIG_H2PCA_TRACE */
+
+/* Copy recorded events ordered by sequence number
+ * @param events  [output] array to store events
+ * @param max_cnt [input] the length of \a events array
+ * @return the count of stored events
+ */
+int h2pca_trace_snapshot(h2pca_trace_event * events, int max_cnt);
+
+/* Write recorded events to the log in hex format.
+ * Use tools/h2pca_trace2json.py to convert the log to Chrome trace JSON
+ */
+void h2pca_trace_dump();
+
+/* Drop all recorded events */
+void h2pca_trace_clear();
+
 // bit operations with state mask
 /* thread-safe get states route */
 h2pca_state h2pca_locked_GET_STATES();